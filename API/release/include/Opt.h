@@ -3,6 +3,7 @@
 typedef struct Opt_State 	Opt_State;
 typedef struct Opt_Plan 	Opt_Plan;
 typedef struct Opt_Problem 	Opt_Problem;
+typedef struct Opt_Solve 	Opt_Solve;
 
 // Parameters that are set once per initialization of Opt
 // A zeroed-out version of this struct is a good default 
@@ -27,16 +28,23 @@ struct Opt_InitializationParameters {
 	// Default block size for kernels (in threads). 
 	// Must be a positive multiple of 32; if not, will default to 256.
 	int threadsPerBlock;
+
+	// If true (nonzero), plans do not keep their own solver temporaries (the linear solve vectors).
+	// They borrow them from memory shared by all plans of the state from Opt_ProblemInit until the
+	// solve ends, so memory grows with the plans solving at the same time, not with the plans created.
+	int sharedSolverScratch;
 };
 
 typedef struct Opt_InitializationParameters 	Opt_InitializationParameters;
 
-// Allocate a new independant context for Opt
+// Allocate a new independant context for Opt.
+// Any thread may call into a state: compilation is serialized by a per-state lock, and different
+// plans can be solved concurrently, but one plan must only be used by one thread at a time
 Opt_State* Opt_NewState(Opt_InitializationParameters params);
 
 // load the problem specification including the energy function from 'filename' and
-// initializer a solver of type 'solverkind' (currently only 'gaussNewtonGPU' 
-// and 'LMGPU' are supported)
+// initializer a solver of type 'solverkind' (currently 'gaussNewtonGPU', 'LMGPU'
+// and 'LMSpeculativeGPU' are supported)
 Opt_Problem* Opt_ProblemDefine(Opt_State* state, const char* filename, const char* solverkind);
 void Opt_ProblemDelete(Opt_State* state, Opt_Problem* problem);
 
@@ -50,6 +58,14 @@ void Opt_PlanFree(Opt_State * state, Opt_Plan* plan);
 // Consult the solver-specific documentation for valid values and names
 void Opt_SetSolverParameter(Opt_State* state, Opt_Plan* plan, const char* name, void* value);
 
+// Bind 'problemparams' (laid out as for Opt_ProblemSolve) to the plan; the array is copied. Afterwards
+// NULL may be passed as 'problemparams' to Opt_ProblemInit, Opt_ProblemStep, Opt_ProblemSolve and
+// Opt_ProblemSolveAsync, which then use the bound parameters without registering the images again.
+void Opt_PlanBindParameters(Opt_State* state, Opt_Plan* plan, void** problemparams);
+// Replace one bound parameter, named as in the energy specification (for graphs, the graph name is its
+// edge count and the vertex names are the index arrays). Returns 0 if there is no such parameter.
+int Opt_PlanUpdateParameter(Opt_State* state, Opt_Plan* plan, const char* name, void* data);
+
 // Run the solver until completion using the plan 'plan'. 'problemparams' are the problem-specific inputs 
 // and outputs that define the problem, including images, graphs, and problem paramaters
 // (see 'writing problem specifications').
@@ -68,4 +84,53 @@ int Opt_ProblemStep(Opt_State* state, Opt_Plan* plan, void** problemparams);
 // Return the result of the cost function evaluated on the current unknowns
 // If the solver is initialized to not use double precision, the return value
 // will be upconverted from a float before being returned
+// The cost is cached by Init and Step, and recomputed only after Opt_PlanBindParameters, Opt_PlanUpdateParameter
+// or an iteration callback returning OPT_ITERATION_PARAMETERS_CHANGED
 double Opt_ProblemCurrentCost(Opt_State* state, Opt_Plan* plan);
+
+// Statistics of one outer iteration. Times are wall-clock milliseconds from a monotonic clock.
+typedef struct Opt_IterationStatistics {
+	double cost;              // cost after the iteration, unchanged if the step was rejected
+	double modelCost;         // cost predicted by the linear model (LM only, 0 for Gauss-Newton)
+	double trustRegionRadius; // radius after the iteration (LM only)
+	double linearResidual;    // r'z of the preconditioned residual at the end of the linear solve
+	double linearMs;          // building and solving the linear system
+	double evaluateMs;        // applying the step and evaluating the cost at the new unknowns
+	double totalMs;           // the whole iteration
+	int linearIterations;
+	int accepted;             // nonzero if the step was kept
+} Opt_IterationStatistics;
+
+// Copy up to 'capacity' entries, one per outer iteration of the current or last solve, into 'statistics'
+// and return the number of iterations recorded. Call with NULL and 0 to get the count.
+int Opt_PlanGetStatistics(Opt_State* state, Opt_Plan* plan, Opt_IterationStatistics* statistics, int capacity);
+// Write the same statistics to 'filename' as "json" (an array of objects) or "csv" (a header and a row per iteration).
+// Returns 0 if the file could not be written or the format is unknown.
+int Opt_PlanWriteStatistics(Opt_State* state, Opt_Plan* plan, const char* filename, const char* format);
+
+// Flags returned by an iteration callback
+#define OPT_ITERATION_CONTINUE 0
+#define OPT_ITERATION_STOP 1               // end the solve after this iteration
+#define OPT_ITERATION_PARAMETERS_CHANGED 2 // values behind the problemparams pointers changed, re-evaluate the cost
+// Called by the solver after every outer iteration with that iteration's statistics and its index in the solve.
+// The unknowns hold the iterate the solver continues from, so they can be copied out here. Scalar parameters
+// are read through their pointers at the start of each iteration, so writing the values changes the rest of the solve.
+typedef int (*Opt_IterationCallback)(const Opt_IterationStatistics* statistics, int iteration, void* userdata);
+// Set the callback of 'plan' (NULL removes it). It runs on the thread that is solving, a worker thread for Opt_ProblemSolveAsync.
+void Opt_SetIterationCallback(Opt_State* state, Opt_Plan* plan, Opt_IterationCallback callback, void* userdata);
+
+// Start solving on Opt's worker pool and return immediately. The 'problemparams' array itself, the scalars and
+// buffers it points to, and 'plan' are used by worker threads until the solve has finished, so they must stay
+// valid and 'plan' must not be used by other calls until Opt_SolveWait returns, also after Opt_SolveCancel.
+Opt_Solve* Opt_ProblemSolveAsync(Opt_State* state, Opt_Plan* plan, void** problemparams);
+// Report the outer iterations completed and the cost after the last one (either pointer may be NULL).
+// Returns nonzero once the solve has finished.
+int Opt_SolvePoll(Opt_State* state, Opt_Solve* solve, int* iteration, double* cost);
+// Ask the solve to stop after the current outer iteration. The iteration in flight keeps using the parameters,
+// so Opt_SolveWait must still be called before they are released.
+void Opt_SolveCancel(Opt_State* state, Opt_Solve* solve);
+// Concurrent solves share the pool's threads one outer iteration at a time. Between iterations the
+// highest priority solve runs next (default 0), and among equal priorities the one closest to its iteration limit.
+void Opt_SolveSetPriority(Opt_State* state, Opt_Solve* solve, int priority);
+// Block until the solve has finished and free 'solve'.
+void Opt_SolveWait(Opt_State* state, Opt_Solve* solve);
@@ -5,7 +5,7 @@ require("precision")
 local use_simplify = true
 local use_condition_factoring = true
 local use_polysimplify = true
-local use_backward_ad = false
+local use_backward_ad = true -- Exp:gradient picks reverse mode when it yields fewer IR nodes
 local List = terralib.newlist
 
 A:Extern("TerraType",terralib.types.istype)
@@ -659,9 +659,88 @@ function Apply:calcd(v)
     return r
 end
 
+-- number of distinct nodes in the DAG of exps
+local function countnodes(exps)
+    local visited,n = {},0
+    local function visit(e)
+        if visited[e] then return end
+        visited[e] = true
+        n = n + 1
+        for i,c in ipairs(e:children()) do
+            visit(c)
+        end
+    end
+    for i,e in ipairs(exps) do
+        visit(e)
+    end
+    return n
+end
+
+-- reverse mode: one sweep from self to its leaves accumulating adjoints, so that subexpressions
+-- shared by the partials of many variables are only differentiated once
+local function backwardgradient(self,vars)
+    local order,visited = terralib.newlist(),{}
+    local function visit(e)
+        if visited[e] then return end
+        visited[e] = true
+        for i,c in ipairs(e:children()) do
+            visit(c)
+        end
+        order:insert(e)
+    end
+    visit(self)
+    local adjoints = { [self] = one }
+    for i = #order,1,-1 do
+        local e = order[i]
+        local a = adjoints[e]
+        if a and Apply:isclassof(e) then
+            local partials = e:partials()
+            for j,c in ipairs(e.args) do
+                if c:type() ~= bool then
+                    local t = a*partials[j]
+                    adjoints[c] = adjoints[c] and adjoints[c] + t or t
+                end
+            end
+        end
+    end
+    return vars:map(function(v)
+        local r = adjoints[v] or zero
+        -- variables that express external relationships to v, see Var:calcd
+        for i,e in ipairs(order) do
+            local k = Var:isclassof(e) and e ~= v and adjoints[e] and e:key()
+            if type(k) == "table" and type(k.gradient) == "function" then
+                local g = k:gradient()[v:key()]
+                if g then
+                    r = r + adjoints[e]*assert(toexp(g),"expected an ad expression")
+                end
+            end
+        end
+        return r
+    end)
+end
+
 --calc d(thisexpress)/d(exps[1]) ... d(thisexpress)/d(exps[#exps]) (i.e. the gradient of this expression with relation to the inputs) 
-function Exp:gradient(exps)
-    return exps:map(function(v) return self:d(v) end)
+--with use_backward_ad, the mode with the smaller result is chosen and cached so that later calls to :d return it,
+--the choice is recorded in self.gradientmode. mode ("forward" or "reverse") overrides the choice
+function Exp:gradient(exps,mode)
+    local forward = exps:map(function(v) return self:d(v) end)
+    if self.gradientmode or not mode and (not use_backward_ad or #exps < 2) then
+        return forward
+    end
+    local backward = backwardgradient(self,exps)
+    local nforward,nbackward = countnodes(forward),countnodes(backward)
+    local reverse = nbackward < nforward
+    if mode then
+        reverse = mode == "reverse"
+    end
+    self.gradientmode = { reverse = reverse, forwardnodes = nforward, reversenodes = nbackward }
+    if not self.gradientmode.reverse then
+        return forward
+    end
+    for i,v in ipairs(exps) do
+        self.derivs[v] = backward[i]
+    end
+    return backward
 end
 
 function ad.sum:generate(exp,args)
@@ -800,6 +879,9 @@ ad.identity:define(function(x) return x end,1) -- preserved across math optimiza
 setmetatable(ad,nil) -- remove special metatable that generates new blank ops
 
 ad.Var,ad.Apply,ad.Const,ad.Exp = Var, Apply, Const, Exp
+-- expressions are unique, and the generators simplify the same subexpressions repeatedly
+-- (sumtoterms recurses into every term), so results are memoized per expression
+local polysimplified = setmetatable({},{__mode = "k"})
 function ad.polysimplify(exps)
     if not use_polysimplify then return exps end
     local function sumtoterms(sum)
@@ -906,7 +988,7 @@ function ad.polysimplify(exps)
         return r
     end
     
-    local function dosimplify(exp)
+    local function dosimplifyuncached(exp)
         if Apply:isclassof(exp) then
             if exp.op.name == "sum" then
                 return simplifylist(sumtoterms(exp))
@@ -922,6 +1004,14 @@ function ad.polysimplify(exps)
             return exp
         end
     end
+    local function dosimplify(exp)
+        local r = polysimplified[exp]
+        if not r then
+            r = dosimplifyuncached(exp)
+            polysimplified[exp] = r
+        end
+        return r
+    end
     return terralib.islist(exps) and exps:map(dosimplify) or dosimplify(exps)
 end
 -- generate two terms, one boolean-only term and one float only term
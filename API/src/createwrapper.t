@@ -105,6 +105,10 @@ struct Opt_InitializationParameters {
     -- Default block size for kernels (in threads). 
     -- Must be a positive multiple of 32; if not, will default to 256.
     threadsPerBlock : int
+
+    -- If true, plans allocate their solver temporaries from memory shared by the state
+    -- while they solve, instead of holding their own for their whole lifetime.
+    sharedSolverScratch : int
 }
 
 for name,type in pairs(apifunctions) do
@@ -153,6 +157,9 @@ local terra NewState(params : Opt_InitializationParameters) : &LibraryState
     C.lua_pushnumber(L,threadsPerBlock);
     C.lua_setfield(L,LUA_GLOBALSINDEX,"_opt_threads_per_block")
 
+    C.lua_pushboolean(L,params.sharedSolverScratch);
+    C.lua_setfield(L,LUA_GLOBALSINDEX,"_opt_shared_scratch")
+
     C.lua_getfield(L,LUA_GLOBALSINDEX,"package")
 
     -- C.lua_setfield(L,LUA_GLOBALSINDEX,)
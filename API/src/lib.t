@@ -32,6 +32,11 @@ return function(P)
     L.Not = ad.not_
     
     function L.UsePreconditioner(...) return P:UsePreconditioner(...) end
+    function L.UseExactHessian(...) return P:UseExactHessian(...) end
+    function L.UseFusedEvaluation(...) return P:UseFusedEvaluation(...) end
+    function L.UseReverseMode(...) return P:UseReverseMode(...) end
+    function L.ScheduleFor(...) return P:ScheduleFor(...) end
+    function L.Specialize(...) return P:Specialize(...) end
     -- alas for Image/Array
     function L.Array(...) return P:Image(...) end
     function L.ComputedArray(...) return P:ComputedImage(...) end
@@ -102,8 +107,17 @@ return function(P)
         -- TODO: check if scalar and just return
         return ad.sqrt(v:dot(v))
     end
+    -- robust losses of the squared norm of a residual, e.g. Energy(Huber(e, delta)).
+    -- The solver reweights J^T F and J^T J with the loss derivatives, no extra unknowns or arrays are needed
+    function L.Huber(val, delta) return ad.robust("huber",val,delta) end
+    function L.Cauchy(val, c) return ad.robust("cauchy",val,c) end
+    function L.Tukey(val, c) return ad.robust("tukey",val,c) end
+
     L.L_p_counter = 1
     function L.L_p(val, val_const, p, dims)
+        if p == nil then -- L_p(val, p): robust loss |val|^p, energy 0.5*|val|^p
+            return ad.robust("lp",val,val_const)
+        end
         local dist_const = L.L_2_norm(val_const)
         local eps = 0.0000001
         local C = ad.pow(dist_const+eps,(p-2))
@@ -18,6 +18,18 @@ local use_conditionalization = true
 local use_contiguous_allocation = false
 local use_bindless_texture = true and (not use_contiguous_allocation)
 local use_cost_speculate = false -- takes a lot of time and doesn't do much
+local use_fused_cost_jtf = true -- default of UseFusedEvaluation: also generate evalJTFCost, so the solver evaluates the cost and J^T F at a new iterate in one pass
+local use_linear_offsets = true -- stencil loads add a constant to the thread's linear offset instead of recomputing it per load
+local SPECULATIVE_CANDIDATES = 3 -- trust region radii evaluated per iteration by the LMSpeculativeGPU solver
+
+local REGISTER_FILE_SIZE = 255 -- registers per thread, live values past this spill in the generated kernels
+-- cost models for the instruction scheduler in createfunction, chosen per problem with ScheduleFor.
+-- registers: live values below which register pressure is not penalized, ilp: issue long dependency chains early.
+-- occupancy minimizes registers everywhere, latency spends registers on instruction-level parallelism
+local schedule_profiles = {
+    occupancy = { registers = 0, ilp = false },
+    latency = { registers = 64, ilp = true },
+}
 
 if false then
     local fileHandle = C.fopen("crap.txt", 'w')
@@ -113,16 +125,38 @@ local ffi = require('ffi')
 
 local problems = {}
 
+-- number of Specialize'd value sets a plan keeps compiled, least recently used ones are freed
+local SPECIALIZATION_CACHE_SIZE = 4
+
 -- this function should do anything it needs to compile an optimizer defined
 -- using the functions in tbl, using the optimizer 'kind' (e.g. kind = gradientdecesnt)
 -- it should generate the field makePlan which is the terra function that 
 -- allocates the plan
 
 local function compilePlan(problemSpec, kind)
-    assert(kind == "gaussNewtonGPU" or kind == "LMGPU" ,"expected solver kind to be gaussNewtonGPU or LMGPU")
+    assert(kind == "gaussNewtonGPU" or kind == "LMGPU" or kind == "LMSpeculativeGPU",
+           "expected solver kind to be gaussNewtonGPU, LMGPU or LMSpeculativeGPU")
     return gaussNewtonGPU(problemSpec)
 end
 
+-- Opt_IterationStatistics, one per outer iteration of the last solve
+struct opt.IterationStatistics {
+    cost : double
+    modelCost : double
+    trustRegionRadius : double
+    linearResidual : double
+    linearMs : double
+    evaluateMs : double
+    totalMs : double
+    linearIterations : int
+    accepted : int
+}
+
+-- Opt_IterationCallback: statistics of the iteration, its index, userdata; returns ITERATION_* flags
+opt.IterationCallback = {&opt.IterationStatistics,int,&opaque} -> int
+opt.ITERATION_STOP = 1 -- end the solve after this iteration
+opt.ITERATION_PARAMETERS_CHANGED = 2 -- values behind the parameter pointers changed, re-evaluate the cost
+
 struct opt.Plan(S.Object) {
     init : {&opaque,&&opaque} -> {} -- plan.data,params
     setsolverparameter : {&opaque,rawstring,&opaque} -> {} -- plan.data,name,param
@@ -130,6 +164,18 @@ struct opt.Plan(S.Object) {
     step : {&opaque,&&opaque} -> int
     cost : {&opaque} -> double
     data : &opaque
+    copysolverparameters : {&opaque,&opaque} -> {} -- dst plan.data, src plan.data
+    remaining : {&opaque} -> int -- plan.data, outer iterations left
+    finish : {&opaque} -> {} -- plan.data, ends a solve stopped before step returned 0
+    bind : {&opaque,&&opaque} -> {} -- plan.data,params
+    boundparameters : {&opaque} -> &&opaque -- plan.data, nil until bound
+    updateparameter : {&opaque,rawstring,&opaque} -> int -- plan.data,name,ptr
+    statistics : {&opaque,&&opt.IterationStatistics} -> int -- plan.data,result: count and array of the last solve
+    callback : opt.IterationCallback -- called after every outer iteration, nil if unset
+    callbackdata : &opaque
+    -- plans of problems with Specialize'd params: picks the plan compiled for the current param values
+    specialize : {&opt.Plan,&&opaque} -> &opt.Plan -- plan,params
+    active : &opt.Plan -- the plan init, step and cost run on, the plan itself unless specialized
 }
 
 struct opt.Problem {} -- just used as an opaque type, pointers are actually just the ID
@@ -172,7 +218,9 @@ Graph = (string name)
 FunctionKind = CenteredFunction(IndexSpace ispace) unique
              | GraphFunction(string graphname) unique
 
-ResidualTemplate = (Exp expression, ImageAccess* unknowns)
+Loss = (string kind, Exp parameter, number channel)
+RobustTerm = (ExpLike expression, string kind, Exp parameter)
+ResidualTemplate = (Exp expression, ImageAccess* unknowns, Loss? loss)
 EnergySpec = (FunctionKind kind, ResidualTemplate* residuals)
 
 FunctionSpec = (FunctionKind kind, string name, string* arguments, ExpLike* results, Scatter* scatters, EnergySpec? derivedfrom)
@@ -212,7 +260,14 @@ function opt.ProblemSpec()
     ps.maxStencil = 0
     ps.stage = "inputs"
     ps.usepreconditioner = false
+    ps.exacthessian = false
+    ps.fusedcostjtf = false
+    ps.fusedevaluation = use_fused_cost_jtf -- requested with UseFusedEvaluation, fusedcostjtf is set once evalJTFCost exists
+    ps.scheduleprofile = "occupancy"
+    ps.derivativemode = nil -- "forward" or "reverse" for every residual, nil to choose per residual
+    ps.specializedparams = List() -- {name,type,idx} of the Specialize'd scalar params
     ps.problemkind = opt.problemkind
+    ps.speculativecandidates = ps.problemkind == "LMSpeculativeGPU" and SPECULATIVE_CANDIDATES or 0
     return ps
 end
 
@@ -220,6 +275,24 @@ function ProblemSpec:UsePreconditioner(v)
     self:Stage "inputs"
     self.usepreconditioner = v
 end
+function ProblemSpec:UseExactHessian(v)
+    self:Stage "inputs"
+    assert(not v or self:UsesLambda(), "UseExactHessian requires the LM solver")
+    self.exacthessian = v
+end
+function ProblemSpec:UseFusedEvaluation(v)
+    self:Stage "inputs"
+    self.fusedevaluation = v
+end
+function ProblemSpec:UseReverseMode(v)
+    self:Stage "inputs"
+    self.derivativemode = v and "reverse" or "forward"
+end
+function ProblemSpec:ScheduleFor(name)
+    self:Stage "inputs"
+    assert(schedule_profiles[name], "unknown schedule profile "..tostring(name))
+    self.scheduleprofile = name
+end
 function ProblemSpec:Stage(name)
     assert(PROBLEM_STAGES[self.stage] <= PROBLEM_STAGES[name], "all inputs must be specified before functions are added")
     self.stage = name
@@ -281,8 +354,8 @@ function A.GraphFunction:__tostring() return tostring(self.graphname) end
 function ProblemSpec:Functions(ft, functions)
     self:Stage "functions"
     for k,v in pairs(functions) do
-        if k ~= "derivedfrom" then
-            v:gettype() -- check they typecheck now
+        if k ~= "derivedfrom" and terralib.isfunction(v) then
+            v:gettype() -- check they typecheck now, generated ones are only emitted when first used
         end
     end
     
@@ -544,6 +617,26 @@ function ImageType:terratype()
             return self.data[idx:tooffset()]
         end
     end
+    -- read at an already linearized offset (idx:tooffset()), not available for 2D textures
+    if not pitched then
+        if textured then
+            terra Image:fetch(offset : int) : vectortype
+                var read = terralib.asm([tuple(float,float,float,float)],
+                    "tex.1d.v4.f32.s32  {$0,$1,$2,$3}, [$4,{$5}];",
+                    "=f,=f,=f,=f,l,r",false, self.tex,offset)
+                return @[&vectortype](&read)
+            end
+        elseif self:LoadAsVector() then
+            terra Image:fetch(offset : int) : vectortype
+                var a = VT(self.data)[offset]
+                return @[&vectortype](&a)
+            end
+        else
+            terra Image:fetch(offset : int) : vectortype
+                return self.data[offset]
+            end
+        end
+    end
     -- writes
     if self:LoadAsVector() then
         terra Image.metamethods.__update(self : &Image, idx : Index, v : vectortype)
@@ -611,6 +704,13 @@ function ImageType:terratype()
                 self.data = nil
             end
         end
+        -- stop using memory the image does not own
+        terra Image:detach()
+            if self.data ~= nil then
+                cd(C.cudaDestroyTextureObject(self.tex))
+                self.data = nil
+            end
+        end
     else
         terra Image:setGPUptr(ptr : &uint8) self.data = [&vectortype](ptr) end
         terra Image:freeData()
@@ -619,6 +719,7 @@ function ImageType:terratype()
                 self.data = nil
             end
         end
+        terra Image:detach() self.data = nil end
     end
     terra Image:initFromGPUptr( ptr : &uint8 )
         self.data = nil
@@ -686,6 +787,11 @@ function UnknownType:UnknownIteratorForIndexSpace(ispace)
     end
 end
 
+local TEXTURE_ALIGNMENT = 512 -- cudaDeviceProp::textureAlignment of current GPUs
+local terra textureAligned(bytes : int64) : int64
+    return (bytes + TEXTURE_ALIGNMENT - 1)/TEXTURE_ALIGNMENT*TEXTURE_ALIGNMENT
+end
+
 function UnknownType:terratype()
     if self._terratype then return self._terratype end
     self._terratype = terralib.types.newstruct("UnknownType")
@@ -694,6 +800,35 @@ function UnknownType:terratype()
     for i,ip in ipairs(images) do
         T.entries:insert { ip.name, ip.imagetype:terratype() }
     end
+    -- bytes of the images when placed one after another by initFromGPUptr, each starting texture aligned
+    terra T:totalbytes() : int64
+        var size : int64 = 0
+        escape
+            for i,ip in ipairs(images) do
+                emit quote size = size + textureAligned(self.[ip.name]:totalbytes()) end
+            end
+        end
+        return size
+    end
+    -- use totalbytes() of memory owned by someone else, e.g. the shared solver scratch; release it with detach()
+    terra T:initFromGPUptr(data : &uint8)
+        var size : int64 = 0
+        escape
+            for i,ip in ipairs(images) do
+                emit quote
+                    self.[ip.name]:initFromGPUptr(data+size)
+                    size = size + textureAligned(self.[ip.name]:totalbytes())
+                end
+            end
+        end
+    end
+    terra T:detach()
+        escape
+            for i,ip in ipairs(images) do
+                emit quote self.[ip.name]:detach() end
+            end
+        end
+    end
     if use_contiguous_allocation then
         T.entries:insert { "_contiguousallocation", &opaque }
         terra T:initGPU()
@@ -858,20 +993,107 @@ local function printCurrentBytes()
     print(collectgarbage("count"))
 end
 
+-- plan -> { problemmetadata, dimensions, params, cache, pending, compiling } for plans with Specialize'd params
+local specializations = {}
+local freePlan -- opt.PlanFree without taking the state lock, which the Lua callbacks already hold
+local submitSpecialization -- queues compileSpecialization for a plan on the solve pool
+
+local function compileProblem(problemmetadata, dimensions, specialization)
+    opt.dimensions = dimensions
+    opt.math = problemmetadata.kind:match("GPU") and util.gpuMath or util.cpuMath
+    opt.problemkind = problemmetadata.kind
+    opt.specialization = specialization
+    local tbl = opt.problemSpecFromFile(problemmetadata.filename)
+    opt.specialization = nil
+    assert(ProblemSpec:isclassof(tbl))
+    return tbl,compilePlan(tbl,problemmetadata.kind)
+end
+
+-- Chooses the plan ProblemInit runs for the current values of the Specialize'd params.
+-- A new set of values is solved with the generic plan, and only compiled if the next
+-- ProblemInit sees the same values again, so values that keep changing never pay for compilation.
+-- The compile runs on the solve pool and the generic plan keeps solving until it lands in the cache
+local function specializePlan(plan, params)
+    local s = specializations[tostring(plan)]
+    local values,keys = {},List()
+    for _,p in ipairs(s.params) do
+        values[p.name] = tonumber(terralib.cast(&p.type,params[p.idx])[0])
+        keys:insert(("%.17g"):format(values[p.name]))
+    end
+    local key = keys:concat(",")
+    for i,entry in ipairs(s.cache) do
+        if entry.key == key then
+            table.insert(s.cache,1,table.remove(s.cache,i))
+            return entry.plan
+        end
+    end
+    if s.pending ~= key then
+        s.pending = key
+        return plan
+    end
+    if s.compiling then
+        return plan -- one compile per plan at a time, these values are tried again when next seen
+    end
+    s.pending = nil
+    s.compiling = { key = key, values = values }
+    submitSpecialization(plan)
+    return plan
+end
+specializePlan = terralib.cast({&opt.Plan,&&opaque} -> &opt.Plan, specializePlan)
+
+-- runs on a pool thread holding stateLock
+local function compileSpecialization(plan)
+    local s = specializations[tostring(plan)]
+    if not s or not s.compiling then
+        return -- the plan was freed while the compile was queued
+    end
+    local c = s.compiling
+    local success,specialized = xpcall(function()
+        local b = terralib.currenttimeinseconds()
+        local _,result = compileProblem(s.problemmetadata, s.dimensions, c.values)
+        print("specialization compile time: ",terralib.currenttimeinseconds() - b)
+        local r = result()
+        activePlans[tostring(r)] = result
+        return r
+    end,function(err) errorPrint(debug.traceback(err,2)) end)
+    s.compiling = nil
+    if not success then
+        return
+    end
+    table.insert(s.cache,1,{ key = c.key, plan = specialized })
+    if #s.cache > SPECIALIZATION_CACHE_SIZE then
+        -- the active plan may be solving right now, so evict the next oldest instead
+        local i = #s.cache
+        if s.cache[i].plan == plan.active then
+            i = i - 1
+        end
+        freePlan(table.remove(s.cache,i).plan)
+    end
+end
+compileSpecialization = terralib.cast({&opt.Plan} -> {}, compileSpecialization)
+
 local function problemPlan(id, dimensions, pplan)
     local success,p = xpcall(function()  
         local problemmetadata = assert(problems[id])
-        opt.dimensions = dimensions
-        opt.math = problemmetadata.kind:match("GPU") and util.gpuMath or util.cpuMath
-        opt.problemkind = problemmetadata.kind
+        -- the Dims read while compiling, copied for compiling specializations later
+        local dims = setmetatable({},{ __index = function(self,idx)
+            local size = tonumber(dimensions[idx])
+            rawset(self,idx,size)
+            return size
+        end })
         local b = terralib.currenttimeinseconds()
-        local tbl = opt.problemSpecFromFile(problemmetadata.filename)
-        assert(ProblemSpec:isclassof(tbl))
-        local result = compilePlan(tbl,problemmetadata.kind)
+        local tbl,result = compileProblem(problemmetadata, dims)
+        -- the caller's dimensions are only valid during ProblemPlan, so keep just the copies
+        setmetatable(dims, nil)
         local e = terralib.currenttimeinseconds()
         print("compile time: ",e - b)
         pplan[0] = result()
         activePlans[tostring(pplan[0])] = result
+        if #tbl.specializedparams > 0 then
+            specializations[tostring(pplan[0])] = { problemmetadata = problemmetadata, dimensions = dims,
+                                                    params = tbl.specializedparams, cache = List() }
+            pplan[0].specialize = specializePlan
+        end
         print("problem plan complete")
 		if _opt_verbosity > 0 then
 	        util.reportGPUMemoryUse()
@@ -884,6 +1106,13 @@ problemPlan = terralib.cast({int,&uint32,&&opt.Plan} -> {}, problemPlan)
 local function planFree(pplan)
     local success,p = xpcall(function()
         activePlans[tostring(pplan)] = nil
+        local s = specializations[tostring(pplan)]
+        if s then
+            specializations[tostring(pplan)] = nil
+            for _,entry in ipairs(s.cache) do
+                freePlan(entry.plan)
+            end
+        end
         if _opt_verbosity > 0 then
 			util.reportGPUMemoryUse()
 		end
@@ -930,6 +1159,7 @@ function ad.Index(d) return IndexValue(d,0):asvar() end
 function ad.ProblemSpec()
     local ps = ProblemSpecAD()
     ps.P,ps.nametoimage,ps.precomputed,ps.extraarguments,ps.excludeexps = opt.ProblemSpec(), {}, List(), List(), List()
+    ps.specialize = {}
     if ps.P:UsesLambda() then
         ps.trust_region_radius = ps:Param("trust_region_radius",opt_float,-1)
         ps.radius_decrease_factor = ps:Param("radius_decrease_factor",opt_float,-1)
@@ -942,6 +1172,26 @@ function ProblemSpecAD:UsesLambda() return self.P:UsesLambda() end
 function ProblemSpecAD:UsePreconditioner(v)
     self.P:UsePreconditioner(v)
 end
+function ProblemSpecAD:UseExactHessian(v)
+    self.P:UseExactHessian(v)
+end
+function ProblemSpecAD:UseFusedEvaluation(v)
+    self.P:UseFusedEvaluation(v)
+end
+function ProblemSpecAD:UseReverseMode(v)
+    self.P:UseReverseMode(v)
+end
+function ProblemSpecAD:ScheduleFor(name)
+    self.P:ScheduleFor(name)
+end
+-- the named Params become compile-time constants, the plan compiles a specialization per set of values
+function ProblemSpecAD:Specialize(...)
+    for i = 1,select("#",...) do
+        local name = select(i,...)
+        assert(not self.P.names[name], "Specialize must come before the declaration of Param "..tostring(name))
+        self.specialize[name] = true
+    end
+end
 
 function ProblemSpecAD:Image(name,typ,dims,idx,isunknown)
     if not terralib.types.istype(typ) then
@@ -1054,6 +1304,14 @@ end
 
 function ProblemSpecAD:Param(name,typ,idx)
     self.P:Param(name,typ,idx)
+    if self.specialize[name] then
+        assert(idx >= 0, "only Params passed by the user can be specialized")
+        self.P.specializedparams:insert { name = name, type = typ, idx = idx }
+        local value = opt.specialization and opt.specialization[name]
+        if value ~= nil then
+            return ad.toexp(value)
+        end
+    end
     return ParamValue(name,typ):asvar()
 end
 
@@ -1128,13 +1386,33 @@ function IndexValue:shift(o)
     return IndexValue(self.dim,self.shift_ + assert(o.data[self.dim+1],"dim of index not in shift"))
 end
 
+-- the generators shift the same residual by the same offsets once per unknown channel,
+-- and each rename walks the whole expression, so shifts are memoized per (exp,offset)
+local shiftcache = setmetatable({},{__mode = "k"})
 local function shiftexp(exp,o)
-    local function rename(a)
-        return ad.v[a:shift(o)]
+    local shifts = shiftcache[exp]
+    if not shifts then
+        shifts = {}
+        shiftcache[exp] = shifts
     end
-    return exp:rename(rename)
+    local r = shifts[o]
+    if not r then
+        local function rename(a)
+            return ad.v[a:shift(o)]
+        end
+        r = exp:rename(rename)
+        shifts[o] = r
+    end
+    return r
 end 
 
+-- d shiftexp(exp,o) / dv, computed as the shift of d exp / d(v shifted by -o).
+-- Exp:d memoizes on exp, so all shifted instances of a residual share one derivative
+-- instead of differentiating every instance separately
+local function shiftedderivative(exp,o,v)
+    return shiftexp(exp:d(ad.v[v:key():shift(o:Invert())]),o)
+end
+
 function Offset:IsZero()
     for i,o in ipairs(self.data) do
         if o ~= 0 then return false end
@@ -1394,6 +1672,17 @@ local function createfunction(problemspec,name,Index,arguments,results,scatters)
     end
     
     local uses,deps = calculateusesanddeps(irroots)
+    
+    local profile = schedule_profiles[problemspec.P.scheduleprofile]
+    -- longest dependency chain from a leaf, in instructions
+    local height = {}
+    for i,ir in ipairs(linearized) do
+        local h = 0
+        for _,c in ipairs(deps[ir]) do
+            h = math.max(h,height[c] + 1)
+        end
+        height[ir] = h
+    end
      
     local function prefixsize(a,b)
         for i = 1,math.huge do
@@ -1515,12 +1804,15 @@ local function createfunction(problemspec,name,Index,arguments,results,scatters)
             return c
         end
 
+        local currentregcount = 1
         local function cost(idx,ir)
             local c =  { 0 }
             if use_condition_scheduling then
                 table.insert(c, conditioncost(currentcondition,ir.condition))
             end
-            if use_register_minimization then
+            if use_register_minimization and currentregcount < profile.registers then
+                table.insert(c, 0) -- registers to spare
+            elseif use_register_minimization then
                 table.insert(c, vardeclcost(ir))
                 if use_cost_speculate then
                     table.insert(c, costspeculate(1,ir))
@@ -1528,6 +1820,10 @@ local function createfunction(problemspec,name,Index,arguments,results,scatters)
                     table.insert(c, costspeculate(0,ir))
                 end
             end
+            if profile.ilp then
+                -- scheduling backwards, so the deepest instruction goes last and its inputs are issued early
+                table.insert(c, -height[ir])
+            end
             return c
         end
         
@@ -1556,7 +1852,6 @@ local function createfunction(problemspec,name,Index,arguments,results,scatters)
         
         local instructions = terralib.newlist()
         local regcounts = terralib.newlist()
-        local currentregcount = 1
         while #ready > 0 do
             local ir = choose()
             instructions:insert(1,ir)
@@ -1569,6 +1864,11 @@ local function createfunction(problemspec,name,Index,arguments,results,scatters)
     end
     
     local instructions,regcounts = schedulebackwards(irroots,uses)
+    local peak = 0
+    for _,r in ipairs(regcounts) do
+        peak = math.max(peak,r)
+    end
+    dprint(("schedule for %s: %d instructions, peak %d live values, ~%d spilled"):format(name,#instructions,peak,math.max(0,peak - REGISTER_FILE_SIZE)))
     
     local function printschedule(W,instructions,regcounts)
         W:write(string.format("schedule for %s -----------\n",name))
@@ -1685,6 +1985,25 @@ local function createfunction(problemspec,name,Index,arguments,results,scatters)
     local function graphref(ge)
         return `P.[ge.graph.name].[ge.element][idx]
     end
+    -- stencil offsets are compile-time constants, so against the linear offset of midx (computed once)
+    -- each load is a single add rather than the multiply-add chain of tooffset
+    local linearidx = symbol(int,"linearidx")
+    local prologue = terralib.newlist()
+    local function stencilread(im,image,off)
+        if not use_linear_offsets or not image.type:terratype().methods.fetch then
+            return `im(midx(off.data))
+        end
+        if #prologue == 0 then
+            prologue:insert(quote var [linearidx] = midx:tooffset() end)
+        end
+        local dims = image.type.ispace.dims
+        local stride,c = 1,0
+        for i = 1,#dims do
+            c = c + stride*off.data[i]
+            stride = stride*dims[i].size
+        end
+        return `im:fetch(linearidx + c)
+    end
     local function createexp(ir)        
         if "const" == ir.kind then
             return `opt_float(ir.value)
@@ -1702,10 +2021,18 @@ local function createfunction(problemspec,name,Index,arguments,results,scatters)
             local a = ir.value
             local im = imageref(a.image)
             if Offset:isclassof(a.index) then
+                local read = stencilread(im,a.image,a.index)
                 if conditioncoversload(ir.condition,a.index) then
-                   return `im(midx(a.index.data))(0) 
+                   return `read(0)
                 else
-                   return `im:get(midx(a.index.data))(0)
+                   return quote
+                        var v : a.image.type:ElementType() = 0.f
+                        if midx(a.index.data):InBounds() then
+                            v = read
+                        end
+                   in
+                        v(0)
+                   end
                 end
             else
                 local gr = graphref(a.index)
@@ -1716,15 +2043,16 @@ local function createfunction(problemspec,name,Index,arguments,results,scatters)
             local im = imageref(a.image)
             local s = symbol(a.image.type:ElementType(),("%s_%s"):format(a.image.name,tostring(a.index)))
             if Offset:isclassof(a.index) then
+                local read = stencilread(im,a.image,a.index)
                 if conditioncoversload(ir.condition,a.index) then
                     statements:insert(quote
-                        var [s] = im(midx(a.index.data))
+                        var [s] = read
                     end)
                 else 
                     statements:insert(quote
                         var [s] = 0.f
                         if midx(a.index.data):InBounds() then
-                            [s] = im(midx(a.index.data))
+                            [s] = read
                         end
                     end)
                 end
@@ -1848,6 +2176,7 @@ local function createfunction(problemspec,name,Index,arguments,results,scatters)
 
     local terra generatedfn([idx], [P], [extraarguments])
         var [midx] = idx
+        [prologue]
         [declarations]
         [statements]
         [scatterstatements]
@@ -1867,6 +2196,18 @@ function ProblemSpecAD:CompileFunctionSpec(functionspec)
     local Index = functionspec.kind.kind == "GraphFunction" and int or functionspec.kind.ispace:indextype()
     return createfunction(self,functionspec.name,Index,functionspec.arguments,functionspec.results,functionspec.scatters)
 end
+-- scheduling and emitting a function spec is deferred to the first kernel that calls it,
+-- so specs whose kernels the solver never launches are never scheduled or compiled.
+-- This still runs serially: the specs are Terra ASTs owned by the one Lua state doing the
+-- compile, and Terra has no thread-safe or cross-state entry point to emit them in parallel
+function ProblemSpecAD:LazyFunctionSpec(functionspec)
+    local fn
+    return macro(function(...)
+        fn = fn or self:CompileFunctionSpec(functionspec)
+        local args = {...}
+        return `fn([args])
+    end)
+end
 
 function ProblemSpecAD:AddFunctions(functionspecs)
     local kind_to_functionmap = {}
@@ -1879,7 +2220,7 @@ function ProblemSpecAD:AddFunctions(functionspecs)
             kinds:insert(fs.kind)
         end
         assert(not fm[fs.name],"function already defined!")
-        fm[fs.name] = self:CompileFunctionSpec(fs)
+        fm[fs.name] = self:LazyFunctionSpec(fs)
         if fm.derivedfrom and fs.derivedfrom then
             assert(fm.derivedfrom == fs.derivedfrom, "not same energy spec?")
         end
@@ -1892,7 +2233,7 @@ function ProblemSpecAD:AddFunctions(functionspecs)
 end
 
 
-local function classifyexpression(exp) -- what index space, or graph is this thing mapped over
+local function classifyexpression(exp,loss) -- what index space, or graph is this thing mapped over
     local classification
     local seenunknown = {}
     local unknownaccesses = terralib.newlist()
@@ -1917,7 +2258,7 @@ local function classifyexpression(exp) -- what index space, or graph is this thi
             classification = aclass
         end
     end)
-    local template = A.ResidualTemplate(exp,unknownaccesses)
+    local template = A.ResidualTemplate(exp,unknownaccesses,loss)
     if not classification then
         error("residual must actually use some image")
     end
@@ -1932,6 +2273,9 @@ local function classifyexpression(exp) -- what index space, or graph is this thi
         local bbox = bboxforexpression(classification.ispace,exp)
         template.expression = ad.select(bbox:asvar(),exp,0)
     end
+    if loss then
+        loss.block[loss.channel+1] = template.expression
+    end
     return classification,template
 end
 
@@ -1982,7 +2326,7 @@ local function handle_unused_unknown_ispaces(kinds,kind_to_templates)
 end
 
 local function toenergyspecs(Rs)    
-    local kinds,kind_to_templates = MapAndGroupBy(Rs,classifyexpression)
+    local kinds,kind_to_templates = MapAndGroupBy(Rs,function(term) return classifyexpression(term.expression,term.loss) end)
     -- We need to execute kernels for unknowns even if they have no unknownwise residuals,
     -- to initialize values for graph residuals and to generally just do PCG/GN bookkeeping
     handle_unused_unknown_ispaces(kinds,kind_to_templates)
@@ -2026,17 +2370,124 @@ end
 
 local EMPTY = List()
 
-local function createjtjcentered(PS,ES)
+-- replace reads of precomputed images with the expressions that define them,
+-- so that the result can be evaluated at unknowns other than the current ones
+local function inlineprecomputed(exp)
+    return exp:rename(function(a)
+        if ImageAccess:isclassof(a) and a.image.expression then
+            assert(Offset:isclassof(a.index),"NYI - precomputed with graphs")
+            return inlineprecomputed(shiftexp(a.image.expression,a.index))
+        end
+        return ad.v[a]
+    end)
+end
+
+-- J P = sum_u dF/du P_u and the unknowns it depends on, with precomputed images inlined
+-- so that second derivatives taken of the result are exact
+local function inlinedjacobianproduct(F,P)
+    local Fi = inlineprecomputed(F)
+    local JP = ad.toexp(0)
+    local unknownvars = List()
+    local seen = {}
+    Fi:visit(function(a)
+        if ImageAccess:isclassof(a) and a.image.location == A.UnknownLocation and not seen[a] then
+            seen[a] = true
+            unknownvars:insert(ad.v[a])
+            JP = JP + Fi:d(ad.v[a])*P[a.image.name](a.index,a.channel)
+        end
+    end)
+    return JP,unknownvars
+end
+
+-- second-order part F * d(J P)/dx of the exact Hessian-vector product (sum_r F_r H_r) P
+local function hessianterm(F,P,x)
+    local JP = inlinedjacobianproduct(F,P)
+    return F*JP:d(x)
+end
+
+-- delta' H delta, the curvature of F along delta, for the exact Hessian model cost
+local function hessiancurvature(F,Delta)
+    local Jdelta,unknownvars = inlinedjacobianproduct(F,Delta)
+    local curvature = ad.toexp(0)
+    for _,uv in ipairs(unknownvars) do
+        local u = uv:key()
+        curvature = curvature + Delta[u.image.name](u.index,u.channel)*Jdelta:d(uv)
+    end
+    return curvature
+end
+
+-- robust losses rho(s) of the squared norm s of a residual block, returning rho, rho' and rho''.
+-- Huber, Cauchy and Tukey are normalized so that rho(s) ~= s for small s. L_p is rho = s^(p/2), which
+-- is not: for p < 2 its weight rho' grows without bound as s goes to 0
+local robustlosses = {}
+function robustlosses.huber(s,a)
+    local r = ad.sqrt(s)
+    local inlier = ad.lesseq(s,a*a)
+    return ad.select(inlier,s,2.0*a*r - a*a), ad.select(inlier,1.0,a/r), ad.select(inlier,0.0,-0.5*a/(s*r))
+end
+function robustlosses.cauchy(s,c)
+    local c2 = c*c
+    local t = 1.0 + s/c2
+    return c2*ad.log(t), 1.0/t, -1.0/(c2*t*t)
+end
+function robustlosses.tukey(s,c)
+    local c2 = c*c
+    local inlier = ad.lesseq(s,c2)
+    local t = 1.0 - s/c2
+    return ad.select(inlier,(c2/3.0)*(1.0 - t*t*t),c2/3.0), ad.select(inlier,t*t,0.0), ad.select(inlier,-2.0*t/c2,0.0)
+end
+function robustlosses.lp(s,p)
+    -- keeps the derivatives finite at s = 0 when p < 2. They are still large there: the IRLS weight
+    -- rho' at s = 0 is (p/2)*1e-7^(p/2 - 1), about 1.6e3 for p = 1, so residuals near 0 get stiff weights
+    local se = s + 0.0000001
+    local h = 0.5*p
+    return ad.pow(se,h), h*ad.pow(se,h-1.0), h*(h-1.0)*ad.pow(se,h-2.0)
+end
+
+-- IRLS weights of a residual: J^T F is weighted by rho' and J^T J by rho' + max(0, 2 s rho'')
+-- (the Triggs correction, as in Ceres only applied where it adds curvature). Blocks with more than
+-- one channel use rho' for both. Residuals without a loss have unit weights
+local unitweights = { gradient = ad.toexp(1), hessian = ad.toexp(1) }
+local function residualweights(residual)
+    local loss = residual.loss
+    if not loss then return unitweights end
+    if not loss.weights then
+        local s = ad.toexp(0)
+        for _,e in ipairs(loss.block) do
+            s = s + e*e
+        end
+        local rho,drho,ddrho = robustlosses[loss.kind](s,loss.parameter)
+        local hessian = drho
+        if #loss.block == 1 then
+            hessian = ad.select(ad.greater(ddrho,0.0),drho + 2.0*s*ddrho,drho)
+        end
+        loss.weights = { rho = rho, gradient = drho, hessian = hessian }
+    end
+    return loss.weights
+end
+
+-- 0.5*F^2, or 0.5*rho(s) for a robust block, counted once on its first channel that is not dropped
+local function residualcost(residual)
+    local F = residual.expression
+    if not residual.loss then
+        return 0.5*F*F
+    elseif residual.loss.channel == residual.loss.block.first then
+        return 0.5*residualweights(residual).rho
+    end
+    return ad.toexp(0)
+end
+
+-- J^T J P at the centered unknown, without the LM diagonal
+local function jtjcenteredproduct(PS,ES,P)
     local UnknownType = PS.P:UnknownType()
     local ispace = ES.kind.ispace
     local N = UnknownType:VectorSizeForIndexSpace(ES.kind.ispace)
-    local P = PS:UnknownArgument(1)
-    local CtC = PS:UnknownArgument(2)
-    --local Pre = PS:UnknownArgument(3)
     local P_hat_c = {}
     local conditions = terralib.newlist()
+    local H_hat = createzerolist(N) -- second-order terms, only used with UseExactHessian
     for rn,residual in ipairs(ES.residuals) do
         local F,unknownsupport = residual.expression,residual.unknowns
+        local W = residualweights(residual).hessian
         lprintf(0,"\n\n\n\n\n##################################################")
         lprintf(0,"r%d = %s",rn,F)
         for idx,unknownname,chan in UnknownType:UnknownIteratorForIndexSpace(ispace) do 
@@ -2045,13 +2496,16 @@ local function createjtjcentered(PS,ES)
             local residuals = residualsincludingX00(unknownsupport,unknown,chan)
             for _,r in ipairs(residuals) do
                 local rexp = shiftexp(F,r)
-                local condition,drdx00 = ad.splitcondition(rexp:d(x))
+                local condition,drdx00 = ad.splitcondition(shiftedderivative(F,r,x))
                 lprintf(1,"instance:\ndr%d_%s/dx00[%d] = %s",rn,tostring(r),chan,tostring(drdx00))
+                if PS.P.exacthessian then
+                    H_hat[idx+1] = H_hat[idx+1] + hessianterm(rexp,P,x)
+                end
                 local unknowns = unknownsforresidual(r,unknownsupport)
                 for _,u in ipairs(unknowns) do
                     local uv = ad.v[u]
-                    local condition2, drdx_u = ad.splitcondition(rexp:d(uv))
-                    local exp = drdx00*drdx_u
+                    local condition2, drdx_u = ad.splitcondition(shiftedderivative(F,r,uv))
+                    local exp = drdx00*drdx_u*shiftexp(W,r)
 
                     lprintf(2,"term:\ndr%d_%s/dx%s[%d] = %s",rn,tostring(r),tostring(u.index),u.chan,tostring(drdx_u))
                     local conditionmerged = condition*condition2
@@ -2071,8 +2525,18 @@ local function createjtjcentered(PS,ES)
         end
     end
     for i,p in ipairs(P_hat) do
-        P_hat[i] = 1.0 * p
+        P_hat[i] = 1.0 * p + H_hat[i]
     end
+    return P_hat
+end
+
+local function createjtjcentered(PS,ES)
+    local UnknownType = PS.P:UnknownType()
+    local ispace = ES.kind.ispace
+    local P = PS:UnknownArgument(1)
+    local CtC = PS:UnknownArgument(2)
+    --local Pre = PS:UnknownArgument(3)
+    local P_hat = jtjcenteredproduct(PS,ES,P)
     if PS:UsesLambda() then
         for idx,unknownname,chan in UnknownType:UnknownIteratorForIndexSpace(ispace) do
             local unknown = PS:ImageWithName(unknownname) 
@@ -2089,9 +2553,8 @@ local function createjtjcentered(PS,ES)
 end
 
 
-local function createjtjgraph(PS,ES)
-    local P,Ap_X = PS:UnknownArgument(1),PS:UnknownArgument(2)
-
+-- scatters J^T J P into Ap_X and returns P^T J^T J P for the graph element
+local function jtjgraphproduct(PS,ES,P,Ap_X)
     local result = ad.toexp(0)
     local scatters = List() 
     local scattermap = {}
@@ -2106,6 +2569,7 @@ local function createjtjgraph(PS,ES)
     end
     for i,term in ipairs(ES.residuals) do
         local F,unknownsupport = term.expression,term.unknowns
+        local W = residualweights(term).hessian
         local unknownvars = unknownsupport:map(function(x) return ad.v[x] end)
         local partials = F:gradient(unknownvars)
         local Jp = ad.toexp(0)
@@ -2116,15 +2580,57 @@ local function createjtjgraph(PS,ES)
         end
         for i,partial in ipairs(partials) do
             local u = unknownsupport[i]
-            local jtjp = 1.0 * Jp*partial
+            local jtjp = W*Jp*partial
+            if PS.P.exacthessian then
+                jtjp = jtjp + F*Jp:d(unknownvars[i])
+            end
             result = result + P[u.image.name](u.index,u.channel)*jtjp
             addscatter(u,jtjp)
         end
     end
+    return result,scatters
+end
 
+local function createjtjgraph(PS,ES)
+    local P,Ap_X = PS:UnknownArgument(1),PS:UnknownArgument(2)
+    local result,scatters = jtjgraphproduct(PS,ES,P,Ap_X)
     return A.FunctionSpec(ES.kind,"applyJTJ", List {"P", "Ap_X"}, List { result }, scatters, ES)
 end
 
+-- argument names prefix1..prefixK, one image per candidate of the LMSpeculativeGPU solver
+local function speculativeargs(prefix,K)
+    local names = List()
+    for k = 1,K do
+        names:insert(prefix..tostring(k))
+    end
+    return names
+end
+
+-- J^T J P_k for the candidate directions of the LMSpeculativeGPU solver, sharing the derivative
+-- evaluations between candidates. The per-candidate LM diagonal is added by the solver
+local function createjtjmulticentered(PS,ES)
+    local K = PS.P.speculativecandidates
+    local results = List()
+    for k = 1,K do
+        local P_hat = ad.polysimplify(jtjcenteredproduct(PS,ES,PS:UnknownArgument(k)))
+        results:insert(ad.Vector(unpack(P_hat)))
+    end
+    return A.FunctionSpec(ES.kind,"applyJTJMulti", speculativeargs("P",K), results, EMPTY,ES)
+end
+
+local function createjtjmultigraph(PS,ES)
+    local K = PS.P.speculativecandidates
+    local results,scatters = List(),List()
+    for k = 1,K do
+        local result,s = jtjgraphproduct(PS,ES,PS:UnknownArgument(k),PS:UnknownArgument(K+k))
+        results:insert(result)
+        scatters:insertall(s)
+    end
+    local arguments = speculativeargs("P",K)
+    arguments:insertall(speculativeargs("Ap_X",K))
+    return A.FunctionSpec(ES.kind,"applyJTJMulti", arguments, results, scatters, ES)
+end
+
 
 local function createjtfcentered(PS,ES)
    local UnknownType = PS.P:UnknownType()
@@ -2136,6 +2642,7 @@ local function createjtfcentered(PS,ES)
     
     for ridx,residual in ipairs(ES.residuals) do
         local F, unknownsupport = residual.expression,residual.unknowns
+        local W = residualweights(residual)
         lprintf(0,"-------------")
         lprintf(1,"R[%d] = %s",ridx,tostring(F))
 
@@ -2148,11 +2655,11 @@ local function createjtfcentered(PS,ES)
             local sum = 0
             for _,f in ipairs(residuals) do
                 local F_x = shiftexp(F,f)
-                local dfdx00 = F_x:d(x)		-- entry of J^T
-                local dfdx00F = dfdx00*F_x	-- entry of \gradF == J^TF
+                local dfdx00 = shiftedderivative(F,f,x)		-- entry of J^T
+                local dfdx00F = dfdx00*F_x*shiftexp(W.gradient,f)	-- entry of \gradF == J^TF
                 F_hat[idx+1] = F_hat[idx+1] + dfdx00F			-- summing it up to get \gradF
 
-                local dfdx00Sq = dfdx00*dfdx00	-- entry of Diag(J^TJ)
+                local dfdx00Sq = dfdx00*dfdx00*shiftexp(W.hessian,f)	-- entry of Diag(J^TJ)
                 P_hat[idx+1] = P_hat[idx+1] + dfdx00Sq			-- summing the pre-conditioner up
                 lprintf(2,"dR[%d]_%s/dx[%d] = %s",ridx,tostring(f),chan,tostring(dfdx00F))
             end
@@ -2171,6 +2678,18 @@ local function createjtfcentered(PS,ES)
     return A.FunctionSpec(ES.kind,"evalJTF", EMPTY, List{ ad.Vector(unpack(F_hat)), ad.Vector(unpack(P_hat)) }, EMPTY,ES)
 end
 
+-- twice the model cost of a residual for the step with J delta = Jdelta:
+-- (F + J delta)^2, or rho(s) + 2 rho' F J delta + w (J delta)^2 for a robust residual
+local function robustmodelresidual(residual,Jdelta)
+    local F = residual.expression
+    if not residual.loss then
+        local residual_m = F + Jdelta
+        return residual_m*residual_m
+    end
+    local W = residualweights(residual)
+    return 2.0*residualcost(residual) + 2.0*W.gradient*F*Jdelta + W.hessian*Jdelta*Jdelta
+end
+
 local function createmodelcost(PS,ES)
     local UnknownType = PS.P:UnknownType()
     local ispace = ES.kind.ispace
@@ -2194,8 +2713,10 @@ local function createmodelcost(PS,ES)
             local delta = Delta[u.image.name](u.index,u.channel)
             JTdelta = JTdelta + (partial * delta)
         end
-        local residual_m = F + JTdelta
-        result = result + (residual_m*residual_m)
+        result = result + robustmodelresidual(residual,JTdelta)
+        if PS.P.exacthessian then
+            result = result + F*hessiancurvature(F,Delta)
+        end
     end
     result = ad.polysimplify(0.5*result)
     return A.FunctionSpec(ES.kind,"modelcost", List {"Delta"}, List{ result }, EMPTY,ES)
@@ -2217,8 +2738,10 @@ local function createmodelcostgraph(PS,ES)
             local delta = Delta[u.image.name](u.index,u.channel)
             JTdelta = JTdelta + (partial * delta)
         end
-        local residual_m = F + JTdelta
-        result = result + (residual_m*residual_m)
+        result = result + robustmodelresidual(term,JTdelta)
+        if PS.P.exacthessian then
+            result = result + F*hessiancurvature(F,Delta)
+        end
     end
     result = ad.polysimplify(0.5*result)
     return A.FunctionSpec(ES.kind, "modelcost", List { "Delta" }, List{ result }, EMPTY,ES)
@@ -2240,18 +2763,210 @@ local function createjtfgraph(PS,ES)
     end
     for i,term in ipairs(ES.residuals) do
         local F,unknownsupport = term.expression,term.unknowns
+        local W = residualweights(term)
         local unknownvars = unknownsupport:map(function(x) return ad.v[x] end)
         local partials = F:gradient(unknownvars)
         for i,partial in ipairs(partials) do
             local u = unknownsupport[i]
             assert(GraphElement:isclassof(u.index))
-            addscatter(R,u,-1.0*partial*F)
-            addscatter(Pre,u,partial*partial)
+            addscatter(R,u,-1.0*partial*F*W.gradient)
+            addscatter(Pre,u,partial*partial*W.hessian)
         end
     end
     return A.FunctionSpec(ES.kind, "evalJTF", List { "R", "Pre" }, EMPTY, scatters,ES)
 end
 
+-- exp evaluated at the unknowns offset by D, x -> x + D
+local function offsetunknowns(exp,D)
+    return inlineprecomputed(exp):rename(function(a)
+        if ImageAccess:isclassof(a) and a.image.location == A.UnknownLocation then
+            return ad.v[a] + D[a.image.name](a.index,a.channel)
+        end
+        return ad.v[a]
+    end)
+end
+
+-- second-order remainder of the residual along the direction Dir:
+-- F(x + Dir) - F(x) - J(x) Dir, which is 0.5*Dir'H(x)Dir + O(|Dir|^3)
+local function secondorderremainder(F,unknownsupport,Dir)
+    local Fshifted = offsetunknowns(F,Dir)
+    local unknownvars = unknownsupport:map(function(x) return ad.v[x] end)
+    local partials = F:gradient(unknownvars)
+    local JDir = ad.toexp(0)
+    for i,partial in ipairs(partials) do
+        local u = unknownsupport[i]
+        JDir = JDir + partial*Dir[u.image.name](u.index,u.channel)
+    end
+    return Fshifted - F - JDir
+end
+
+-- J^T (F(x + Dir) - F(x) - J Dir), used by the LM solver for geodesic acceleration
+local function creategeodesicjtfcentered(PS,ES)
+    local UnknownType = PS.P:UnknownType()
+    local ispace = ES.kind.ispace
+    local N = UnknownType:VectorSizeForIndexSpace(ispace)
+    local Dir = PS:UnknownArgument(1)
+    local F_hat = createzerolist(N)
+
+    for ridx,residual in ipairs(ES.residuals) do
+        local F, unknownsupport = residual.expression,residual.unknowns
+        local Fvv = secondorderremainder(F,unknownsupport,Dir)
+        for idx,unknownname,chan in UnknownType:UnknownIteratorForIndexSpace(ispace) do
+            local unknown = PS:ImageWithName(unknownname)
+            local x = unknown(ispace:ZeroOffset(),chan)
+            local residuals = residualsincludingX00(unknownsupport,unknown,chan)
+            for _,f in ipairs(residuals) do
+                F_hat[idx+1] = F_hat[idx+1] + shiftedderivative(F,f,x)*shiftexp(Fvv*residualweights(residual).hessian,f)
+            end
+        end
+    end
+    for i = 1,N do
+        F_hat[i] = ad.polysimplify(F_hat[i])
+    end
+    return A.FunctionSpec(ES.kind,"evalGeodesicJTF", List {"Dir"}, List{ ad.Vector(unpack(F_hat)) }, EMPTY,ES)
+end
+
+local function creategeodesicjtfgraph(PS,ES)
+    local Dir,R = PS:UnknownArgument(1),PS:UnknownArgument(2)
+    local scatters = List()
+    local scattermap = {}
+    local function addscatter(u,exp)
+        local s = scattermap[u]
+        if not s then
+            s =  Scatter(R[u.image.name],u.index,u.channel,ad.toexp(0),"add")
+            scattermap[u] = s
+            scatters:insert(s)
+        end
+        s.expression = s.expression + exp
+    end
+    for i,term in ipairs(ES.residuals) do
+        local F,unknownsupport = term.expression,term.unknowns
+        local Fvv = secondorderremainder(F,unknownsupport,Dir)
+        local unknownvars = unknownsupport:map(function(x) return ad.v[x] end)
+        local partials = F:gradient(unknownvars)
+        for i,partial in ipairs(partials) do
+            local u = unknownsupport[i]
+            assert(GraphElement:isclassof(u.index))
+            addscatter(u,partial*Fvv*residualweights(term).hessian)
+        end
+    end
+    return A.FunctionSpec(ES.kind, "evalGeodesicJTF", List { "Dir", "R" }, EMPTY, scatters, ES)
+end
+
+-- An unknown image is local if every residual reads it at a single index. Its Hessian block is then
+-- block diagonal (one channelcount x channelcount block per element), so given the other unknowns
+-- it can be solved for in closed form per element (e.g. the rotations in ARAP energies).
+local MAX_LOCAL_CHANNELS = 3 -- the off-diagonal entries of a block must fit in channelcount entries
+local function findlocalunknowns(UnknownType,energyspecs)
+    local indices = {}
+    for _,ES in ipairs(energyspecs) do
+        for _,residual in ipairs(ES.residuals) do
+            local seen = {}
+            for _,u in ipairs(residual.unknowns) do
+                local name = u.image.name
+                if seen[name] and seen[name] ~= u.index then
+                    indices[name] = false
+                end
+                seen[name] = u.index
+                if indices[name] == nil then indices[name] = true end
+            end
+        end
+    end
+    local localunknowns,nlocal = {},0
+    for _,ip in ipairs(UnknownType.images) do
+        if indices[ip.name] and ip.imagetype.channelcount <= MAX_LOCAL_CHANNELS then
+            localunknowns[ip.name] = true
+            nlocal = nlocal + 1
+        end
+    end
+    if nlocal == 0 or nlocal == #UnknownType.images then
+        return nil
+    end
+    return localunknowns
+end
+
+-- index of the entry (a,b), a < b, in the packed strict upper triangle of an n x n block
+local function localpairindex(a,b,n)
+    local k = 0
+    for i = 0,a-1 do
+        k = k + n - 1 - i
+    end
+    return k + b - a - 1
+end
+
+-- gradient J^T F and the per-element blocks J_u^T J_u of the local unknowns, other channels are zero.
+-- The block diagonal goes in the second result and its strict upper triangle in the third,
+-- packed starting at the first channel of each image
+local function createlocalsystemcentered(PS,ES)
+    local UnknownType = PS.P:UnknownType()
+    local ispace = ES.kind.ispace
+    local N = UnknownType:VectorSizeForIndexSpace(ispace)
+    local G,Hd,Ho = createzerolist(N),createzerolist(N),createzerolist(N)
+    for ridx,residual in ipairs(ES.residuals) do
+        local F, unknownsupport = residual.expression,residual.unknowns
+        for idx,unknownname,chan in UnknownType:UnknownIteratorForIndexSpace(ispace) do
+            if PS.P.localunknowns[unknownname] then
+                local unknown = PS:ImageWithName(unknownname)
+                local nchannels = unknown.type.channelcount
+                local x = unknown(ispace:ZeroOffset(),chan)
+                for _,f in ipairs(residualsincludingX00(unknownsupport,unknown,chan)) do
+                    local F_x = shiftexp(F,f)
+                    local W = residualweights(residual)
+                    local wg,wh = shiftexp(W.gradient,f),shiftexp(W.hessian,f)
+                    local dfdx = shiftedderivative(F,f,x)
+                    G[idx+1] = G[idx+1] + dfdx*F_x*wg
+                    Hd[idx+1] = Hd[idx+1] + dfdx*dfdx*wh
+                    for c2 = chan+1,nchannels-1 do
+                        local k = idx - chan + localpairindex(chan,c2,nchannels)
+                        Ho[k+1] = Ho[k+1] + dfdx*shiftedderivative(F,f,unknown(ispace:ZeroOffset(),c2))*wh
+                    end
+                end
+            end
+        end
+    end
+    for i = 1,N do
+        G[i],Hd[i],Ho[i] = ad.polysimplify(G[i]),ad.polysimplify(Hd[i]),ad.polysimplify(Ho[i])
+    end
+    return A.FunctionSpec(ES.kind,"evalLocalSystem", EMPTY, List{ ad.Vector(unpack(G)), ad.Vector(unpack(Hd)), ad.Vector(unpack(Ho)) }, EMPTY,ES)
+end
+
+local function createlocalsystemgraph(PS,ES)
+    local R,Hd,Ho = PS:UnknownArgument(1),PS:UnknownArgument(2),PS:UnknownArgument(3)
+    local scatters = List()
+    local scattermap = { [R] = {}, [Hd] = {}, [Ho] = {} }
+    local function addscatter(im,u,channel,exp)
+        local key = im[u.image.name](u.index,channel)
+        local s = scattermap[im][key]
+        if not s then
+            s =  Scatter(im[u.image.name],u.index,channel,ad.toexp(0),"add")
+            scattermap[im][key] = s
+            scatters:insert(s)
+        end
+        s.expression = s.expression + exp
+    end
+    for i,term in ipairs(ES.residuals) do
+        local F,unknownsupport = term.expression,term.unknowns
+        local unknownvars = unknownsupport:map(function(x) return ad.v[x] end)
+        local partials = F:gradient(unknownvars)
+        for i,partial in ipairs(partials) do
+            local u = unknownsupport[i]
+            if PS.P.localunknowns[u.image.name] then
+                assert(GraphElement:isclassof(u.index))
+                local nchannels = u.image.type.channelcount
+                local W = residualweights(term)
+                addscatter(R,u,u.channel,partial*F*W.gradient)
+                addscatter(Hd,u,u.channel,partial*partial*W.hessian)
+                for j,u2 in ipairs(unknownsupport) do
+                    if u2.image == u.image and u2.index == u.index and u2.channel > u.channel then
+                        addscatter(Ho,u,localpairindex(u.channel,u2.channel,nchannels),partial*partials[j]*W.hessian)
+                    end
+                end
+            end
+        end
+    end
+    return A.FunctionSpec(ES.kind, "evalLocalSystem", List { "R", "Hd", "Ho" }, EMPTY, scatters, ES)
+end
+
 local function computeCtCcentered(PS,ES)
    local UnknownType = PS.P:UnknownType()
    local ispace = ES.kind.ispace
@@ -2270,9 +2985,8 @@ local function computeCtCcentered(PS,ES)
             local residuals = residualsincludingX00(unknownsupport,unknown,chan)
             local sum = 0
             for _,f in ipairs(residuals) do
-                local F_x = shiftexp(F,f)
-                local dfdx00 = F_x:d(x)     -- entry of J^T
-                local dfdx00Sq = dfdx00*dfdx00  -- entry of Diag(J^TJ)
+                local dfdx00 = shiftedderivative(F,f,x)     -- entry of J^T
+                local dfdx00Sq = dfdx00*dfdx00*shiftexp(residualweights(residual).hessian,f)  -- entry of Diag(J^TJ)
 
                 local inv_radius = 1.0 / PS.trust_region_radius
                 local D_entry = dfdx00Sq*inv_radius 
@@ -2287,8 +3001,8 @@ local function computeCtCcentered(PS,ES)
     return A.FunctionSpec(ES.kind,"computeCtC", List { }, List{ ad.Vector(unpack(D_hat)) }, EMPTY,ES)
 end
 
-local function computeCtCgraph(PS,ES)
-    local CtC = PS:UnknownArgument(1),PS:UnknownArgument(2)
+local function computeCtCgraph(PS,ES,CtC)
+    CtC = CtC or PS:UnknownArgument(1)
     local scatters = List() 
     local scattermap = { [CtC] = {}}
 
@@ -2309,7 +3023,7 @@ local function computeCtCgraph(PS,ES)
             local u = unknownsupport[i]
             assert(GraphElement:isclassof(u.index))
             local inv_radius = 1.0 / PS.trust_region_radius
-            addscatter(CtC,u,partial*partial*inv_radius)
+            addscatter(CtC,u,partial*partial*residualweights(term).hessian*inv_radius)
         end
     end
     return A.FunctionSpec(ES.kind, "computeCtC", List { "CtC" }, EMPTY, scatters, ES)
@@ -2373,17 +3087,53 @@ local function creategradient(unknown,costexp)
 end
     
 local function createcost(ES)
-    local function sumsquared(terms)
-        local sum = ad.toexp(0)
-        for i,t in ipairs(terms) do
-            sum = sum + t*t
-        end
-        return 0.5*sum
+    local exp = ad.toexp(0)
+    for i,residual in ipairs(ES.residuals) do
+        exp = exp + residualcost(residual)
     end
-    local exp = sumsquared(ES.residuals:map("expression"))
     return A.FunctionSpec(ES.kind,"cost", EMPTY, List{exp}, EMPTY,ES) 
 end
 
+-- cost at X + Delta_k for each candidate step of the LMSpeculativeGPU solver, so that candidates
+-- can be compared without applying and reverting them
+local function createspeculativecost(PS,ES)
+    local K = PS.P.speculativecandidates
+    local results = List()
+    for k = 1,K do
+        local Delta = PS:UnknownArgument(k)
+        local exp = ad.toexp(0)
+        for i,residual in ipairs(ES.residuals) do
+            exp = exp + offsetunknowns(residualcost(residual),Delta)
+        end
+        results:insert(exp)
+    end
+    return A.FunctionSpec(ES.kind,"speculativecost", speculativeargs("Delta",K), results, EMPTY,ES)
+end
+
+-- cost, J^T F, the preconditioner and (for LM) the unclamped C^T C in one function, so the solver
+-- can evaluate them in a single pass after an update instead of in separate cost, evalJTF and
+-- computeCtC passes. Results are shared by the scheduler, so common subexpressions are computed once
+local function createfusedjtfcost(PS,ES)
+    local cost = createcost(ES)
+    if ES.kind.kind == "CenteredFunction" then
+        local results = List()
+        results:insertall(createjtfcentered(PS,ES).results)
+        results:insertall(cost.results)
+        if PS:UsesLambda() then
+            results:insertall(computeCtCcentered(PS,ES).results)
+        end
+        return A.FunctionSpec(ES.kind,"evalJTFCost", EMPTY, results, EMPTY,ES)
+    end
+    local arguments = List { "R", "Pre" }
+    local scatters = List()
+    scatters:insertall(createjtfgraph(PS,ES).scatters)
+    if PS:UsesLambda() then
+        arguments:insert("CtC")
+        scatters:insertall(computeCtCgraph(PS,ES,PS:UnknownArgument(3)).scatters)
+    end
+    return A.FunctionSpec(ES.kind,"evalJTFCost", arguments, cost.results, scatters,ES)
+end
+
 function createprecomputed(self,precomputedimages)
 
     local ispaces,image_map = MapAndGroupBy(precomputedimages,function(im) return im.type.ispace,im end)
@@ -2408,26 +3158,146 @@ function createprecomputed(self,precomputedimages)
     return precomputes
 end
 local function extractresidualterms(...)
-    local exp = terralib.newlist {}
+    local terms = terralib.newlist {}
     for i = 1, select("#",...) do
         local e = select(i,...)
-        if ad.ExpVector:isclassof(e) then
-            for i,t in ipairs(e:expressions()) do
-                t = assert(ad.toexp(t), "expected an ad expression")
-                exp:insert(t)
+        local kind,parameter
+        if A.RobustTerm:isclassof(e) then
+            e,kind,parameter = e.expression,e.kind,e.parameter
+        end
+        local exps = ad.ExpVector:isclassof(e) and e:expressions() or List { e }
+        -- the channels of a robust term share one loss of their squared norm. The block keeps every
+        -- channel, zeros included, so s stays the norm of the whole block when zero channels are dropped
+        local block = List()
+        for c,t in ipairs(exps) do
+            t = assert(ad.toexp(t), "expected an ad expression")
+            block[c] = t
+            -- a residual that is identically 0 (e.g. its Specialize'd weight is 0) is dropped
+            if not (t.kind == "Const" and t.v == 0) then
+                local loss
+                if kind then
+                    loss = A.Loss(kind,parameter,c-1)
+                    loss.block = block
+                    block.first = block.first or c-1 -- the channel that carries the block's cost
+                end
+                terms:insert { expression = t, loss = loss }
             end
-        else
-            exp:insert((assert(ad.toexp(e), "expected an ad expression")))
         end
     end
-    return exp
+    return terms
+end
+-- wraps a scalar or Vector residual in a robust loss of its squared norm, see Huber, Cauchy, Tukey and L_p in lib.t
+function ad.robust(kind,exp,parameter)
+    assert(robustlosses[kind], "unknown robust loss "..tostring(kind))
+    return A.RobustTerm(exp,kind,assert(ad.toexp(parameter),"expected a number or expression as the loss parameter"))
+end
+
+-- Residuals written in a Stencil loop are the same expression with some accesses moved by a
+-- constant offset. Returns the map from the accesses of T to those of F if F is such an instance
+-- of T, with every moved access moved by the same offset, nil otherwise
+local function matchstencilfamily(T,F)
+    local matched,targets,mapping = {},{},{}
+    local offset
+    local function moved(a,b)
+        if ImageAccess:isclassof(a) and ImageAccess:isclassof(b) then
+            if a.image ~= b.image or a.channel ~= b.channel
+               or not Offset:isclassof(a.index) or not Offset:isclassof(b.index) then
+                return nil
+            end
+            return b.index:shift(a.index:Invert())
+        elseif BoundsAccess:isclassof(a) and BoundsAccess:isclassof(b) then
+            local d = b.min:shift(a.min:Invert())
+            return d == b.max:shift(a.max:Invert()) and d or nil
+        end
+    end
+    local function match(a,b)
+        if matched[a] then return matched[a] == b end
+        if targets[b] then return false end -- the renaming has to be invertible
+        matched[a],targets[b] = b,a
+        if a.kind ~= b.kind then return false end
+        if a.kind == "Const" then
+            return a.v == b.v
+        elseif a.kind == "Var" then
+            local ka,kb = a:key(),b:key()
+            -- the derivative of a ComputedArray with gradient images reads those gradient images, which
+            -- are not in the mapping, so residuals using one are never renamed, even where it did not move
+            if ImageAccess:isclassof(ka) and ka.image.gradientimages
+               or ImageAccess:isclassof(kb) and kb.image.gradientimages then
+                return false
+            end
+            mapping[ka] = kb
+            if ka == kb then return true end
+            local d = moved(ka,kb)
+            offset = offset or d
+            return d ~= nil and d == offset
+        end
+        if a.op ~= b.op or a.const ~= b.const or #a.args ~= #b.args then return false end
+        for i,c in ipairs(a.args) do
+            if not match(c,b.args[i]) then return false end
+        end
+        return true
+    end
+    return match(T,F) and mapping or nil
+end
+
+-- chooses forward or reverse mode once per residual (see Exp:gradient) unless 'mode' fixes it,
+-- and derives the derivatives of Stencil family members from their family's first residual by
+-- renaming instead of differentiating each member
+local function seedresidualderivatives(energyspecs,mode)
+    for _,energyspec in ipairs(energyspecs) do
+        local templates = List()
+        for _,residual in ipairs(energyspec.residuals) do
+            local F = residual.expression
+            local template,mapping
+            for _,T in ipairs(templates) do
+                mapping = matchstencilfamily(T.expression,F)
+                if mapping then
+                    template = T
+                    break
+                end
+            end
+            if template then
+                local T = template.expression
+                local inverse = {}
+                for ka,kb in pairs(mapping) do
+                    inverse[kb] = ka
+                end
+                local function rename(k) return ad.v[mapping[k]] end
+                F.derivs = F.derivs or {}
+                for _,u in ipairs(residual.unknowns) do
+                    local tu = inverse[u]
+                    F.derivs[ad.v[u]] = tu and T:d(ad.v[tu]):rename(rename) or ad.toexp(0)
+                end
+                F.gradientmode = T.gradientmode
+                template.members = template.members + 1
+            else
+                F:gradient(residual.unknowns:map(function(u) return ad.v[u] end),mode)
+                templates:insert { expression = F, members = 1 }
+            end
+        end
+        for _,T in ipairs(templates) do
+            local mode = T.expression.gradientmode
+            dprint(("residual %d: %d stencil instances, %s-mode derivatives"):format(T.expression.id,T.members,
+                   mode and (mode.reverse and "reverse" or "forward").." ("..mode.forwardnodes.." IR nodes forward, "..mode.reversenodes.." reverse)" or "forward"))
+        end
+    end
 end
+
 function ProblemSpecAD:Cost(...)
     local terms = extractresidualterms(...)
     local functionspecs = List()
     local energyspecs = toenergyspecs(terms)
+    for _,term in ipairs(terms) do
+        assert(not (term.loss and self.P.exacthessian), "UseExactHessian does not support robust losses")
+    end
+    assert(not (self.P.exacthessian and self.P.speculativecandidates > 0), "UseExactHessian is not supported by the LMSpeculativeGPU solver")
+    self.P.localunknowns = findlocalunknowns(self.P:UnknownType(),energyspecs)
+    seedresidualderivatives(energyspecs,self.P.derivativemode)
     for _,energyspec in ipairs(energyspecs) do
         functionspecs:insert(createcost(energyspec))          
+        if self.P.fusedevaluation then
+            functionspecs:insert(createfusedjtfcost(self,energyspec))
+        end
         if energyspec.kind.kind == "CenteredFunction" then
             functionspecs:insert(createjtjcentered(self,energyspec))
             functionspecs:insert(createjtfcentered(self,energyspec))
@@ -2436,6 +3306,14 @@ function ProblemSpecAD:Cost(...)
             if self.P:UsesLambda() then
                 functionspecs:insert(computeCtCcentered(self,energyspec))
                 functionspecs:insert(createmodelcost(self,energyspec))
+                functionspecs:insert(creategeodesicjtfcentered(self,energyspec))
+            end
+            if self.P.speculativecandidates > 0 then
+                functionspecs:insert(createjtjmulticentered(self,energyspec))
+                functionspecs:insert(createspeculativecost(self,energyspec))
+            end
+            if self.P.localunknowns then
+                functionspecs:insert(createlocalsystemcentered(self,energyspec))
             end
         else
             functionspecs:insert(createjtjgraph(self,energyspec))
@@ -2444,7 +3322,15 @@ function ProblemSpecAD:Cost(...)
             
             if self.P:UsesLambda() then
                 functionspecs:insert(computeCtCgraph(self,energyspec))
-                functionspecs:insert(createmodelcostgraph(self,energyspec))         
+                functionspecs:insert(createmodelcostgraph(self,energyspec))
+                functionspecs:insert(creategeodesicjtfgraph(self,energyspec))
+            end
+            if self.P.speculativecandidates > 0 then
+                functionspecs:insert(createjtjmultigraph(self,energyspec))
+                functionspecs:insert(createspeculativecost(self,energyspec))
+            end
+            if self.P.localunknowns then
+                functionspecs:insert(createlocalsystemgraph(self,energyspec))
             end
         end
     end
@@ -2456,6 +3342,7 @@ function ProblemSpecAD:Cost(...)
     
     self:AddFunctions(functionspecs)
     self.P.energyspecs = energyspecs
+    self.P.fusedcostjtf = self.P.fusedevaluation
     return self.P
 end
 
@@ -2517,43 +3404,313 @@ opt.toispace = toispace
 -- C API implementation functions
 -- WARNING: if you change these you need to update release/Opt.h
 
+-- Every entry point that runs Lua (defining, planning, freeing and specializing) holds stateLock,
+-- so any thread may call them. Init, step and cost only run compiled code on the plan's own PlanData,
+-- so different plans can be solved on different threads at the same time
+local T = util.threads
+local stateLock = global(T.opt_mutex)
+local terra initStateLock() T.opt_mutex_init(&stateLock) end
+initStateLock()
+
+-- threads for async solves and specialization compiles, started on first use and
+-- joined when the last plan is freed. Only changed holding stateLock.
+-- Solves are not given their own share of the threads: a solve runs one outer iteration on one
+-- thread at a time (its kernels run on the GPU), so all solves share one priority queue, and the
+-- threads are not pinned to cores or NUMA nodes
+local solvepool = global(&util.WorkerPool,nil)
+local liveplans = global(int,0) -- plans from ProblemPlan not yet freed
+local terra startSolvePool()
+    if solvepool == nil then
+        solvepool = [&util.WorkerPool](C.malloc(sizeof(util.WorkerPool)))
+        solvepool:init(T.opt_cpu_count())
+    end
+end
+
 -- define just stores meta-data right now. ProblemPlan does all compilation for now
 terra opt.ProblemDefine(filename : rawstring, kind : rawstring)
     var id : int
+    T.opt_mutex_lock(&stateLock)
     problemDefine(filename, kind, &id)
+    T.opt_mutex_unlock(&stateLock)
     return [&opt.Problem](id)
 end 
 terra opt.ProblemDelete(p : &opt.Problem)
     var id = int(int64(p))
+    T.opt_mutex_lock(&stateLock)
     problemDelete(id)
+    T.opt_mutex_unlock(&stateLock)
 end
 terra opt.ProblemPlan(problem : &opt.Problem, dimensions : &uint32) : &opt.Plan
     var p : &opt.Plan = nil 
+    T.opt_mutex_lock(&stateLock)
     problemPlan(int(int64(problem)),dimensions,&p)
+    if p ~= nil then
+        liveplans = liveplans + 1
+    end
+    T.opt_mutex_unlock(&stateLock)
     return p
 end
 
-terra opt.PlanFree(plan : &opt.Plan)
+terra freePlan(plan : &opt.Plan)
     plan.free(plan.data)
     planFree(plan)
     plan:delete()
 end
-
+terra opt.PlanFree(plan : &opt.Plan)
+    T.opt_mutex_lock(&stateLock)
+    freePlan(plan)
+    liveplans = liveplans - 1
+    var pool : &util.WorkerPool = nil
+    if liveplans == 0 then
+        pool,solvepool = solvepool,nil
+    end
+    T.opt_mutex_unlock(&stateLock)
+    -- outside stateLock, which queued specialization compiles take before finding their plan gone
+    if pool ~= nil then
+        pool:shutdown()
+        C.free(pool)
+    end
+end
+
+local terra selectActivePlan(plan : &opt.Plan, params : &&opaque)
+    if plan.specialize ~= nil then
+        -- a specialization compiling on the pool holds stateLock, and the generic plan
+        -- is correct for any values, so solve with it rather than wait for the compile
+        if T.opt_mutex_trylock(&stateLock) ~= 0 then
+            plan.active = plan.specialize(plan, params)
+            T.opt_mutex_unlock(&stateLock)
+        else
+            plan.active = plan
+        end
+        if plan.active ~= plan then
+            plan.active.copysolverparameters(plan.active.data, plan.data)
+            plan.active.callback,plan.active.callbackdata = plan.callback,plan.callbackdata
+        end
+    end
+end
+-- selects the active plan and returns the params to pass it: nil when the call got none, which
+-- means the parameters bound to the plan, and those are then bound to the active plan as well
+local terra prepareActivePlan(plan : &opt.Plan, params : &&opaque) : &&opaque
+    if params ~= nil then
+        selectActivePlan(plan, params)
+        return params
+    end
+    var bound = plan.boundparameters(plan.data)
+    if bound == nil then
+        C.printf("Opt error: no problem parameters were passed and none were bound with Opt_PlanBindParameters\n")
+        C.exit(1)
+    end
+    selectActivePlan(plan, bound)
+    if plan.active ~= plan then
+        plan.active.bind(plan.active.data, bound)
+    end
+    return nil
+end
+terra opt.PlanBindParameters(plan : &opt.Plan, params : &&opaque)
+    plan.bind(plan.data, params)
+end
+terra opt.PlanUpdateParameter(plan : &opt.Plan, name : rawstring, data : &opaque) : int
+    if plan.active ~= plan and plan.active.boundparameters(plan.active.data) ~= nil then
+        plan.active.updateparameter(plan.active.data, name, data)
+    end
+    return plan.updateparameter(plan.data, name, data)
+end
 terra opt.ProblemInit(plan : &opt.Plan, params : &&opaque) 
-    return plan.init(plan.data, params)
+    var activeparams = prepareActivePlan(plan, params)
+    return plan.active.init(plan.active.data, activeparams)
 end
 terra opt.ProblemStep(plan : &opt.Plan, params : &&opaque) : int
-    return plan.step(plan.data, params)
+    return plan.active.step(plan.active.data, params)
 end
 terra opt.ProblemSolve(plan : &opt.Plan, params : &&opaque)
    opt.ProblemInit(plan, params)
    while opt.ProblemStep(plan, params) ~= 0 do end
 end
 terra opt.ProblemCurrentCost(plan : &opt.Plan) : double
-    return plan.cost(plan.data)
+    return plan.active.cost(plan.active.data)
+end
+
+-- copies up to 'capacity' entries and returns the number of outer iterations recorded
+terra opt.PlanGetStatistics(plan : &opt.Plan, statistics : &opt.IterationStatistics, capacity : int) : int
+    var recorded : &opt.IterationStatistics
+    var count = plan.active.statistics(plan.active.data, &recorded)
+    for i = 0,count do
+        if i < capacity then statistics[i] = recorded[i] end
+    end
+    return count
+end
+
+-- one row or object per iteration, with the fields of opt.IterationStatistics in order
+local writeStatistics
+do
+    local entries = opt.IterationStatistics.entries
+    local function fmt(e) return e.type == int and "%d" or "%.17g" end
+    local csvheader = "iteration,"..entries:map(function(e) return e.field end):concat(",").."\n"
+    local csvrow = "%d,"..entries:map(fmt):concat(",").."\n"
+    local function values(s) return entries:map(function(e) return `[s].[e.field] end) end
+    -- JSON has no NaN or Infinity, so those are written as null
+    local terra jsonnumber(file : &C.FILE, v : double)
+        if v - v == 0 then C.fprintf(file, "%.17g", v) else C.fprintf(file, "null") end
+    end
+    terra writeStatistics(file : &C.FILE, stats : &opt.IterationStatistics, count : int, json : bool)
+        if json then C.fprintf(file, "[\n") else C.fprintf(file, csvheader) end
+        for i = 0,count do
+            if json then
+                if i > 0 then C.fprintf(file, ",\n") end
+                C.fprintf(file, '  {"iteration": %d', i)
+                escape
+                    for _,e in ipairs(entries) do
+                        emit quote C.fprintf(file, [(', "%s": '):format(e.field)]) end
+                        if e.type == int then
+                            emit quote C.fprintf(file, "%d", stats[i].[e.field]) end
+                        else
+                            emit quote jsonnumber(file, stats[i].[e.field]) end
+                        end
+                    end
+                end
+                C.fprintf(file, "}")
+            else
+                C.fprintf(file, csvrow, i, [values(`stats[i])])
+            end
+        end
+        if json then C.fprintf(file, "\n]\n") end
+    end
+end
+terra opt.PlanWriteStatistics(plan : &opt.Plan, filename : rawstring, format : rawstring) : int
+    var json = C.strcmp(format, "json") == 0
+    if not json and C.strcmp(format, "csv") ~= 0 then
+        C.printf("Opt: unknown statistics format %s, expected json or csv\n", format)
+        return 0
+    end
+    var file = C.fopen(filename, "w")
+    if file == nil then return 0 end
+    var recorded : &opt.IterationStatistics
+    var count = plan.active.statistics(plan.active.data, &recorded)
+    writeStatistics(file, recorded, count, json)
+    C.fclose(file)
+    return 1
+end
+
+-- asynchronous solves run the compiled init/step of the plan on the worker pool. The plan is
+-- chosen on the calling thread, so the workers never enter the Lua state
+struct opt.Solve {
+    plan : &opt.Plan
+    params : &&opaque
+    pool : &util.WorkerPool
+    lock : T.opt_mutex
+    finished : T.opt_cond
+    priority : int
+    started : bool
+    iteration : int
+    cost : double
+    cancelled : bool
+    done : bool
+}
+
+local terra runSpecializationCompile(plan : &opaque)
+    T.opt_mutex_lock(&stateLock)
+    C.cudaFree(nil) -- makes the device context current on this pool thread before loading kernels
+    compileSpecialization([&opt.Plan](plan))
+    T.opt_mutex_unlock(&stateLock)
+end
+-- called holding stateLock, from specializePlan
+terra submitSpecialization(plan : &opt.Plan)
+    startSolvePool()
+    solvepool:submit(runSpecializationCompile, plan, 0, 0)
+end
+
+-- runs one iteration of a solve and queues the rest behind it, so concurrent solves share the
+-- pool's threads and are reordered by priority and remaining iterations between iterations
+local terra runSolve(s_ : &opaque)
+    var s = [&opt.Solve](s_)
+    var plan = s.plan
+    C.cudaFree(nil) -- makes the device context current on this pool thread before launching kernels
+    T.opt_mutex_lock(&s.lock)
+    var cancelled = s.cancelled
+    T.opt_mutex_unlock(&s.lock)
+    var more = not cancelled
+    if more then
+        if not s.started then
+            plan.init(plan.data, s.params)
+            s.started = true
+        else
+            more = plan.step(plan.data, s.params) ~= 0
+            var cost = plan.cost(plan.data)
+            -- the step that ends the solve may not run an iteration, so count the recorded ones
+            var recorded : &opt.IterationStatistics
+            var iterations = plan.statistics(plan.data, &recorded)
+            T.opt_mutex_lock(&s.lock)
+            s.iteration = iterations
+            s.cost = cost
+            T.opt_mutex_unlock(&s.lock)
+        end
+    end
+    if cancelled and s.started then
+        plan.finish(plan.data) -- step never returned 0, so the solve was not ended yet
+    end
+    T.opt_mutex_lock(&s.lock)
+    if more then
+        s.pool:submit(runSolve, s, s.priority, plan.remaining(plan.data))
+    else
+        s.done = true
+        T.opt_cond_broadcast(&s.finished)
+    end
+    T.opt_mutex_unlock(&s.lock)
+end
+
+terra opt.ProblemSolveAsync(plan : &opt.Plan, params : &&opaque) : &opt.Solve
+    T.opt_mutex_lock(&stateLock)
+    startSolvePool()
+    var pool = solvepool
+    T.opt_mutex_unlock(&stateLock)
+    var activeparams = prepareActivePlan(plan, params)
+    var s = [&opt.Solve](C.malloc(sizeof(opt.Solve)))
+    s.plan,s.params,s.pool = plan.active,activeparams,pool
+    T.opt_mutex_init(&s.lock)
+    T.opt_cond_init(&s.finished)
+    s.priority,s.started = 0,false
+    s.iteration,s.cost,s.cancelled,s.done = 0,0.0,false,false
+    pool:submit(runSolve, s, s.priority, plan.active.remaining(plan.active.data))
+    return s
+end
+terra opt.SolveSetPriority(s : &opt.Solve, priority : int)
+    T.opt_mutex_lock(&s.lock)
+    s.priority = priority
+    T.opt_mutex_unlock(&s.lock)
+end
+terra opt.SolvePoll(s : &opt.Solve, iteration : &int, cost : &double) : int
+    T.opt_mutex_lock(&s.lock)
+    var done = s.done
+    if iteration ~= nil then @iteration = s.iteration end
+    if cost ~= nil then @cost = s.cost end
+    T.opt_mutex_unlock(&s.lock)
+    return int(done)
+end
+terra opt.SolveCancel(s : &opt.Solve)
+    T.opt_mutex_lock(&s.lock)
+    s.cancelled = true
+    T.opt_mutex_unlock(&s.lock)
+end
+terra opt.SolveWait(s : &opt.Solve)
+    T.opt_mutex_lock(&s.lock)
+    while not s.done do
+        T.opt_cond_wait(&s.finished,&s.lock)
+    end
+    T.opt_mutex_unlock(&s.lock)
+    T.opt_cond_destroy(&s.finished)
+    T.opt_mutex_destroy(&s.lock)
+    C.free(s)
+end
+
+terra opt.SetIterationCallback(plan : &opt.Plan, callback : opt.IterationCallback, userdata : &opaque)
+    plan.callback,plan.callbackdata = callback,userdata
+    plan.active.callback,plan.active.callbackdata = callback,userdata
 end
 
 terra opt.SetSolverParameter(plan : &opt.Plan, name : rawstring, value : &opaque) 
+    if plan.active ~= plan then
+        plan.active.setsolverparameter(plan.active.data, name, value)
+    end
     return plan.setsolverparameter(plan.data, name, value)
 end
 
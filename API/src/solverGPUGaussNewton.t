@@ -20,7 +20,8 @@ local initialization_parameters = {
     use_cusparse = false,
     use_fused_jtj = false,
     guardedInvertType = GuardedInvertType.CERES,
-    jacobiScaling = JacobiScalingType.ONCE_PER_SOLVE
+    jacobiScaling = JacobiScalingType.ONCE_PER_SOLVE,
+    anderson_max_depth = 5 -- upper bound on the anderson_depth solver parameter
 }
 
 local solver_parameter_defaults = {
@@ -35,7 +36,14 @@ local solver_parameter_defaults = {
     min_lm_diagonal = 1e-6,
     max_lm_diagonal = 1e32,
     nIterations = 10,
-    lIterations = 10
+    lIterations = 10,
+    use_geodesic_acceleration = 0,
+    geodesic_step_size = 0.1,
+    geodesic_acceptance_ratio = 0.75,
+    anderson_depth = 0,
+    steihaug_radius = 1e3,
+    eliminate_local_unknowns = 0,
+    time_budget_ms = 0
 }
 
 
@@ -93,6 +101,47 @@ end
 local gpuMath = util.gpuMath
 
 local FLOAT_EPSILON = `[opt_float](0.00000001f) 
+
+-- Solves the small symmetric positive definite n x n system A x = b in place by Cholesky, for per-thread use.
+-- Returns false if A is not positive definite
+local choleskySolve = terralib.memoize(function(n)
+    return terra(A : &opt_float, b : &opt_float, x : &opt_float) : bool
+        for j = 0,n do
+            var s = A[j*n+j]
+            for k = 0,j do
+                s = s - A[j*n+k]*A[j*n+k]
+            end
+            if s <= opt_float(0.0f) then
+                return false
+            end
+            var l = gpuMath.sqrt(s)
+            A[j*n+j] = l
+            for i = j+1,n do
+                var t = A[i*n+j]
+                for k = 0,j do
+                    t = t - A[i*n+k]*A[j*n+k]
+                end
+                A[i*n+j] = t / l
+            end
+        end
+        for i = 0,n do
+            var t = b[i]
+            for k = 0,i do
+                t = t - A[i*n+k]*x[k]
+            end
+            x[i] = t / A[i*n+i]
+        end
+        for ii = 0,n do
+            var i = n - 1 - ii
+            var t = x[i]
+            for k = i+1,n do
+                t = t - A[k*n+i]*x[k]
+            end
+            x[i] = t / A[i*n+i]
+        end
+        return true
+    end
+end)
 -- GAUSS NEWTON (or LEVENBERG-MARQUADT)
 return function(problemSpec)
     local UnknownType = problemSpec:UnknownType()
@@ -144,6 +193,43 @@ return function(problemSpec)
     end
     
     local isGraph = problemSpec:UsesGraphs() 
+    local ANDERSON_MAX_DEPTH = initialization_parameters.anderson_max_depth
+
+    -- LMSpeculativeGPU: number of trust region radii solved for per iteration, 0 for the other solvers
+    local K = problemSpec.speculativecandidates
+    local SPEC_K = math.max(K,1) -- array length, so that PlanData has the same layout for every solver
+
+    -- length of the problemparams array passed by the user
+    local NPARAMS = 1
+    for _,entry in ipairs(problemSpec.parameters) do
+        if type(entry.idx) == "number" then
+            NPARAMS = math.max(NPARAMS, entry.idx + 1)
+        end
+        if entry.kind == "GraphParam" then
+            for _,e in ipairs(entry.type.metamethods.elements) do
+                NPARAMS = math.max(NPARAMS, e.idx + 1)
+            end
+        end
+    end
+    assert(K == 0 or not initialization_parameters.use_cusparse, "LMSpeculativeGPU does not support use_cusparse")
+    -- layout of specReductions: K entries for each of
+    local SPEC_ALPHA_NUM, SPEC_ALPHA_DEN, SPEC_BETA_NUM, SPEC_Q, SPEC_COST, SPEC_MODEL_COST, SPEC_SLOTS = 0,1,2,3,4,5,6
+
+    -- argument lists for the generated functions that take one image per candidate
+    local function specImages(pd,name)
+        local images = terralib.newlist()
+        for k = 0,K-1 do
+            images:insert(`pd.[name][k])
+        end
+        return images
+    end
+    local function specSymbols(typ)
+        local syms = terralib.newlist()
+        for k = 1,K do
+            syms:insert(symbol(typ))
+        end
+        return syms
+    end
     
     local struct SolverParameters {
         min_relative_decrease : float
@@ -155,11 +241,18 @@ return function(problemSpec)
         radius_decrease_factor : float
         min_lm_diagonal : float
         max_lm_diagonal : float
+        geodesic_step_size : float          -- finite difference step for the second directional derivative
+        geodesic_acceptance_ratio : float   -- accept the correction a if 2|a|/|v| is below this
+        steihaug_radius : float -- initial bound on |delta| for the truncated CG solve, only used with UseExactHessian
+        time_budget_ms : float  -- wall-clock limit for one solve, 0 disables it
 
         residual_reset_period : int
         nIter : int             --current non-linear iter counter
         nIterations : int       --non-linear iterations
         lIterations : int       --linear iterations
+        use_geodesic_acceleration : int -- LM only: add the geodesic acceleration correction to each step
+        anderson_depth : int    --number of previous iterates used for Anderson acceleration, 0 disables it
+        eliminate_local_unknowns : int -- alternate closed-form per-element solves for local unknowns with the global solve
     }
 
     
@@ -184,6 +277,76 @@ return function(problemSpec)
 
         prevX : TUnknownType -- Place to copy unknowns to before speculatively updating. Avoids hassle when (X + delta) - delta != X 
 
+        -- with sharedSolverScratch the vectors above are borrowed from util.scratcharena from init until the solve ends
+        scratchData : &uint8
+        scratchBytes : int64
+
+        -- geodesic acceleration (LM only), allocated on first use
+        velocity : TUnknownType -- first-order step v; delta holds the acceleration a while it is solved for
+        geodesicDirection : TUnknownType -- h*v, the residuals are re-evaluated at X + h*v
+        geodesicNorms : &opt_float -- |a|^2 and |v|^2, scaled by the LM diagonal
+        geodesicWeight : opt_float -- 0.5 if the correction is accepted, 0 otherwise
+        geodesicAllocated : bool
+
+        -- Anderson acceleration of the outer loop, allocated on first use
+        andersonDX : TUnknownType[ANDERSON_MAX_DEPTH] -- differences of successive iterates x_{k+1} - x_k
+        andersonDF : TUnknownType[ANDERSON_MAX_DEPTH] -- differences of successive steps f_{k+1} - f_k
+        andersonPrevX : TUnknownType
+        andersonPrevF : TUnknownType
+        andersonBackup : TUnknownType -- unknowns before mixing, restored if mixing does not decrease the cost
+        andersonDots : &opt_float -- DF'DF followed by DF'f
+        andersonGamma : opt_float[ANDERSON_MAX_DEPTH] -- mixing coefficients, set on the host before andersonMix
+        andersonHistory : int -- number of valid columns of DX and DF
+        andersonIterates : int -- number of (x,f) pairs recorded during this solve
+        andersonSlot : int -- column of DX and DF written next
+        andersonAllocatedDepth : int
+
+        -- Steihaug truncated CG, only used with UseExactHessian
+        steihaugDots : &opt_float -- delta'delta, delta'p, p'p
+        steihaugTau : opt_float -- step length along p to the trust region boundary
+        steihaugRadius : opt_float -- current bound on |delta|
+        steihaugHitBoundary : bool -- the last linear solve was truncated at the boundary
+
+        -- fused evaluation (evalJTFCost): r, preconditioner and CtC hold -J'F, the raw preconditioner and the
+        -- unclamped C'C at the current unknowns, computed together with the cost at trust region radius jtfRadius
+        jtfValid : bool
+        jtfRadius : opt_float
+
+        -- blocks before this index run the centered half of a fused launch, set by util's fused launchers
+        graphBlockOffset : int
+
+        -- time_budget_ms: outer iteration time is modeled as a + b*(linear iterations), fitted by least
+        -- squares over this solve's iterations (count, sum n, sum t, sum n^2, sum n*t); bestX holds the
+        -- lowest-cost unknowns seen, returned when the solve ends
+        solveStartMs : double
+        budgetFit : double[5]
+        linearIterations : int -- linear iterations allowed in the current step
+        linearIterationsRun : int
+        budgetActive : bool
+        bestX : TUnknownType
+        bestAllocated : bool
+        bestCost : opt_float
+
+        -- Opt_PlanBindParameters: a copy of the problemparams array, used when init and step get none.
+        -- Images are registered when bound or updated, so solves with unchanged buffers keep their textures
+        bound : (&opaque)[NPARAMS]
+        paramsBound : bool
+
+        -- Opt_PlanGetStatistics: one entry per outer iteration of the current or last solve
+        statistics : util.Array(opt.IterationStatistics)
+
+        -- speculative LM, one PCG solve per candidate radius, only allocated for LMSpeculativeGPU
+        specDelta : TUnknownType[SPEC_K]
+        specR : TUnknownType[SPEC_K]
+        specZ : TUnknownType[SPEC_K]
+        specP : TUnknownType[SPEC_K]
+        specAp : TUnknownType[SPEC_K]
+        specPre : TUnknownType[SPEC_K]
+        specCtC : TUnknownType[SPEC_K] -- clamped LM diagonal of each candidate
+        specReductions : &opt_float -- see SPEC_SLOTS
+        specRadius : opt_float[SPEC_K] -- trust region radius of each candidate, set on the host
+        specBest : int -- candidate copied into delta by specAccept
+
         scanAlphaNumerator : &opt_float
         scanAlphaDenominator : &opt_float
         scanBetaNumerator : &opt_float
@@ -195,6 +358,10 @@ return function(problemSpec)
         endSolver : util.TimerEvent
 
         prevCost : opt_float
+        -- prevCost is the cost of the current unknowns and parameters while costEpoch == parameterEpoch;
+        -- binding or updating parameters advances parameterEpoch, so the next use recomputes it
+        costEpoch : uint64
+        parameterEpoch : uint64
         
         J_csrValA : &opt_float
         J_csrColIndA : &int
@@ -316,6 +483,39 @@ return function(problemSpec)
             end
         end end)
 
+        -- channel ranges of the local unknowns (see eliminate_local_unknowns) in this index space
+        local localblocks = terralib.newlist()
+        if problemSpec.localunknowns then
+            local offset = 0
+            for _,ip in ipairs(UnknownType.ispacetoimages[UnknownIndexSpace]) do
+                if problemSpec.localunknowns[ip.name] then
+                    localblocks:insert { offset = offset, count = ip.imagetype.channelcount }
+                end
+                offset = offset + ip.imagetype.channelcount
+            end
+        end
+
+        -- zeroes the preconditioner on local unknowns so that the global PCG solve leaves them fixed
+        local maskLocal = macro(function(pd,pre)
+            if #localblocks == 0 then
+                return pre
+            end
+            return quote
+                var masked = pre
+                if pd.solverparameters.eliminate_local_unknowns ~= 0 then
+                    escape
+                        for _,block in ipairs(localblocks) do
+                            for c = 0,block.count-1 do
+                                emit quote masked(block.offset+c) = opt_float(0.0f) end
+                            end
+                        end
+                    end
+                end
+            in
+                masked
+            end
+        end)
+
         local terra square(x : opt_float) : opt_float
             return x*x
         end
@@ -358,6 +558,26 @@ return function(problemSpec)
             return result
         end
 
+        -- clamped LM diagonal C'C for the trust region radius and the matching preconditioner
+        local lmDiagonal = macro(function(pd,idx,unclampedCtC,radius) return quote
+                var invS_iiSq : unknownElement = opt_float(1.0f)
+                if [initialization_parameters.jacobiScaling == JacobiScalingType.ONCE_PER_SOLVE] then
+                    invS_iiSq = opt_float(1.0f) / pd.SSq(idx)
+                elseif [initialization_parameters.jacobiScaling == JacobiScalingType.EVERY_ITERATION] then 
+                    invS_iiSq = opt_float(1.0f) / pd.preconditioner(idx)
+                end -- else if  [initialization_parameters.jacobiScaling == JacobiScalingType.NONE] then invS_iiSq == 1
+                var clampMultiplier = invS_iiSq / radius
+                var minVal = pd.parameters.min_lm_diagonal * clampMultiplier
+                var maxVal = pd.parameters.max_lm_diagonal * clampMultiplier
+                var CtC = clamp(unclampedCtC, minVal, maxVal)
+
+                -- Calculate true preconditioner, taking into account the diagonal
+                var pre = opt_float(1.0f) / (CtC+radius*unclampedCtC) 
+            in
+                CtC, pre
+            end
+        end)
+
         terra kernels.PCGInit1(pd : PlanData)
             var d : opt_float = opt_float(0.0f) -- init for out of bounds lanes
         
@@ -383,6 +603,9 @@ return function(problemSpec)
             
                 if (not fmap.exclude(idx,pd.parameters)) and (not isGraph) then		
                     pre = guardedInvert(pre)
+                    if not [problemSpec:UsesLambda()] then -- LM masks in PCGFinalizeDiagonal, it needs the full diagonal here
+                        pre = maskLocal(pd,pre)
+                    end
                     var p = pre*residuum	-- apply pre-conditioner M^-1			   
                     pd.p(idx) = p
                 
@@ -396,6 +619,66 @@ return function(problemSpec)
             end
         end
     
+        if problemSpec.fusedcostjtf then
+            terra kernels.computeCostAndJTF(pd : PlanData)
+                var cost = opt_float(0.0f)
+                var idx : Index
+                if idx:initFromCUDAParams() then
+                    var residuum : unknownElement = 0.0f
+                    var pre : unknownElement = 0.0f
+                    if not fmap.exclude(idx,pd.parameters) then
+                        escape
+                            if problemSpec:UsesLambda() then
+                                emit quote
+                                    var CtC : unknownElement
+                                    residuum, pre, cost, CtC = fmap.evalJTFCost(idx, pd.parameters)
+                                    pd.CtC(idx) = CtC
+                                end
+                            else
+                                emit quote
+                                    residuum, pre, cost = fmap.evalJTFCost(idx, pd.parameters)
+                                end
+                            end
+                        end
+                        pd.r(idx) = -residuum
+                        if not problemSpec.usepreconditioner then
+                            pre = opt_float(1.0f)
+                        end
+                    end
+                    pd.preconditioner(idx) = pre
+                end
+                cost = util.warpReduce(cost)
+                if (util.laneid() == 0) then
+                    util.atomicAdd(pd.scratch, cost)
+                end
+            end
+
+            -- PCGInit1 (and PCGInit1_Graph, PCGInit1_Finish) from the values left by computeCostAndJTF
+            terra kernels.PCGInit1_Fused(pd : PlanData)
+                var d : opt_float = opt_float(0.0f)
+                var idx : Index
+                if idx:initFromCUDAParams() and not fmap.exclude(idx,pd.parameters) then
+                    pd.delta(idx) = opt_float(0.0f)
+                    var residuum = pd.r(idx)
+                    var pre = guardedInvert(pd.preconditioner(idx))
+                    if [isGraph and not problemSpec.usepreconditioner] then
+                        pre = opt_float(1.0f)
+                    end
+                    if [problemSpec:UsesLambda()] then
+                        -- C'C is proportional to 1/trust_region_radius, which may have changed since it was computed
+                        pd.CtC(idx) = (pd.jtfRadius / pd.parameters.trust_region_radius)*pd.CtC(idx)
+                    else
+                        pre = maskLocal(pd,pre)
+                    end
+                    var p = pre*residuum
+                    pd.preconditioner(idx) = pre
+                    pd.p(idx) = p
+                    d = residuum:dot(p)
+                end
+                unknownWideReduction(idx,d,pd.scanAlphaNumerator)
+            end
+        end
+    
         terra kernels.PCGInit1_Finish(pd : PlanData)	--only called for graphs
             var d : opt_float = opt_float(0.0f) -- init for out of bounds lanes
             var idx : Index
@@ -408,6 +691,9 @@ return function(problemSpec)
                 if not problemSpec.usepreconditioner then
                     pre = opt_float(1.0f)
                 end
+                if not [problemSpec:UsesLambda()] then
+                    pre = maskLocal(pd,pre)
+                end
             
                 var p = pre*residuum	-- apply pre-conditioner M^-1
                 pd.preconditioner(idx) = pre
@@ -468,6 +754,7 @@ return function(problemSpec)
                 if not problemSpec.usepreconditioner then
                     pre = opt_float(1.0f)
                 end
+                pre = maskLocal(pd,pre)
         
                 var z = pre*r										-- apply pre-conditioner M^-1
                 pd.z(idx) = z;										-- save for next kernel call
@@ -517,6 +804,7 @@ return function(problemSpec)
                 if not problemSpec.usepreconditioner then
                     pre = opt_float(1.0f)
                 end
+                pre = maskLocal(pd,pre)
                 var z = pre*r       -- apply pre-conditioner M^-1
                 pd.z(idx) = z;      -- save for next kernel call
                 betaNum = z:dot(r)        -- compute x-th term of the numerator of beta
@@ -575,7 +863,129 @@ return function(problemSpec)
             if idx:initFromCUDAParams() and not fmap.exclude(idx,pd.parameters) then
                 pd.prevX(idx) = pd.parameters.X(idx)
             end
-        end 
+        end
+
+        terra kernels.saveBestUnknowns(pd : PlanData)
+            var idx : Index
+            if idx:initFromCUDAParams() and not fmap.exclude(idx,pd.parameters) then
+                pd.bestX(idx) = pd.parameters.X(idx)
+            end
+        end
+
+        terra kernels.restoreBestUnknowns(pd : PlanData)
+            var idx : Index
+            if idx:initFromCUDAParams() and not fmap.exclude(idx,pd.parameters) then
+                pd.parameters.X(idx) = pd.bestX(idx)
+            end
+        end
+
+        -- x_k is in prevX and the step f_k = g(x_k) - x_k is in delta
+        terra kernels.andersonUpdateHistory(pd : PlanData)
+            var idx : Index
+            if idx:initFromCUDAParams() and not fmap.exclude(idx,pd.parameters) then
+                var x = pd.prevX(idx)
+                var f = pd.delta(idx)
+                if pd.andersonIterates > 0 then
+                    pd.andersonDX[pd.andersonSlot](idx) = x - pd.andersonPrevX(idx)
+                    pd.andersonDF[pd.andersonSlot](idx) = f - pd.andersonPrevF(idx)
+                end
+                pd.andersonPrevX(idx) = x
+                pd.andersonPrevF(idx) = f
+            end
+        end
+
+        terra kernels.andersonComputeDots(pd : PlanData)
+            var idx : Index
+            var valid = idx:initFromCUDAParams() and not fmap.exclude(idx,pd.parameters)
+            for i = 0,pd.andersonHistory do
+                for j = i,pd.andersonHistory do
+                    var d = opt_float(0.0f)
+                    if valid then
+                        d = pd.andersonDF[i](idx):dot(pd.andersonDF[j](idx))
+                    end
+                    unknownWideReduction(idx,d,pd.andersonDots + i*ANDERSON_MAX_DEPTH + j)
+                end
+                var e = opt_float(0.0f)
+                if valid then
+                    e = pd.andersonDF[i](idx):dot(pd.delta(idx))
+                end
+                unknownWideReduction(idx,e,pd.andersonDots + ANDERSON_MAX_DEPTH*ANDERSON_MAX_DEPTH + i)
+            end
+        end
+
+        -- X currently holds x_k + f_k
+        terra kernels.andersonMix(pd : PlanData)
+            var idx : Index
+            if idx:initFromCUDAParams() and not fmap.exclude(idx,pd.parameters) then
+                var x = pd.parameters.X(idx)
+                pd.andersonBackup(idx) = x
+                for i = 0,pd.andersonHistory do
+                    x = x - pd.andersonGamma[i]*(pd.andersonDX[i](idx) + pd.andersonDF[i](idx))
+                end
+                pd.parameters.X(idx) = x
+            end
+        end
+
+        terra kernels.andersonRevert(pd : PlanData)
+            var idx : Index
+            if idx:initFromCUDAParams() and not fmap.exclude(idx,pd.parameters) then
+                pd.parameters.X(idx) = pd.andersonBackup(idx)
+            end
+        end
+
+        if #localblocks > 0 then
+            -- r, Ap_X and z are free before PCGInit1, they hold J^T F and the block diagonal of J^T J
+            -- (diagonal in Ap_X, strict upper triangles in z) for the local unknowns
+            terra kernels.localSystemInit(pd : PlanData)
+                var idx : Index
+                if idx:initFromCUDAParams() and not fmap.exclude(idx,pd.parameters) then
+                    var g, hd, ho = fmap.evalLocalSystem(idx, pd.parameters)
+                    pd.r(idx), pd.Ap_X(idx), pd.z(idx) = g, hd, ho
+                end
+            end
+
+            -- Gauss-Newton update of the local unknowns with all other unknowns fixed, one block per thread
+            terra kernels.localSolve(pd : PlanData)
+                var idx : Index
+                if idx:initFromCUDAParams() and not fmap.exclude(idx,pd.parameters) then
+                    var g, hd, ho = pd.r(idx), pd.Ap_X(idx), pd.z(idx)
+                    var step : unknownElement = opt_float(0.0f)
+                    var damping = opt_float(pd.solverparameters.min_lm_diagonal)
+                    escape
+                        for _,block in ipairs(localblocks) do
+                            local n,o = block.count,block.offset
+                            emit quote
+                                var H : opt_float[n*n]
+                                var b : opt_float[n]
+                                var x : opt_float[n]
+                                escape
+                                    local k = 0
+                                    for a = 0,n-1 do
+                                        emit quote
+                                            H[a*n+a] = hd(o+a) + damping*util.gpuMath.fmax(hd(o+a),opt_float(1.0f))
+                                            b[a] = -g(o+a)
+                                        end
+                                        for c = a+1,n-1 do
+                                            emit quote
+                                                H[a*n+c] = ho(o+k)
+                                                H[c*n+a] = ho(o+k)
+                                            end
+                                            k = k + 1
+                                        end
+                                    end
+                                end
+                                if [choleskySolve(n)](&H[0],&b[0],&x[0]) then
+                                    for a = 0,n do
+                                        step(o+a) = x[a]
+                                    end
+                                end
+                            end
+                        end
+                    end
+                    pd.parameters.X(idx) = pd.parameters.X(idx) + step
+                end
+            end
+        end
 
         terra kernels.computeCost(pd : PlanData)
             var cost : opt_float = opt_float(0.0f)
@@ -634,20 +1044,9 @@ return function(problemSpec)
                 var q = opt_float(0.0f)
                 if idx:initFromCUDAParams() and not fmap.exclude(idx,pd.parameters) then 
                     var unclampedCtC = pd.CtC(idx)
-                    var invS_iiSq : unknownElement = opt_float(1.0f)
-                    if [initialization_parameters.jacobiScaling == JacobiScalingType.ONCE_PER_SOLVE] then
-                        invS_iiSq = opt_float(1.0f) / pd.SSq(idx)
-                    elseif [initialization_parameters.jacobiScaling == JacobiScalingType.EVERY_ITERATION] then 
-                        invS_iiSq = opt_float(1.0f) / pd.preconditioner(idx)
-                    end -- else if  [initialization_parameters.jacobiScaling == JacobiScalingType.NONE] then invS_iiSq == 1
-                    var clampMultiplier = invS_iiSq / pd.parameters.trust_region_radius
-                    var minVal = pd.parameters.min_lm_diagonal * clampMultiplier
-                    var maxVal = pd.parameters.max_lm_diagonal * clampMultiplier
-                    var CtC = clamp(unclampedCtC, minVal, maxVal)
+                    var CtC, pre = lmDiagonal(pd, idx, unclampedCtC, pd.parameters.trust_region_radius)
                     pd.CtC(idx) = CtC
-                    
-                    -- Calculate true preconditioner, taking into account the diagonal
-                    var pre = opt_float(1.0f) / (CtC+pd.parameters.trust_region_radius*unclampedCtC) 
+                    pre = maskLocal(pd,pre)
                     pd.preconditioner(idx) = pre
                     var residuum = pd.r(idx)
                     pd.b(idx) = residuum -- copy over to b
@@ -677,6 +1076,235 @@ return function(problemSpec)
                 end
             end
 
+            terra kernels.saveGeodesicVelocity(pd : PlanData)
+                var idx : Index
+                if idx:initFromCUDAParams() and not fmap.exclude(idx,pd.parameters) then
+                    var v = pd.delta(idx)
+                    pd.velocity(idx) = v
+                    pd.geodesicDirection(idx) = opt_float(pd.solverparameters.geodesic_step_size)*v
+                end
+            end
+
+            terra kernels.computeGeodesicRHS(pd : PlanData)
+                var idx : Index
+                if idx:initFromCUDAParams() and not fmap.exclude(idx,pd.parameters) then
+                    pd.r(idx) = fmap.evalGeodesicJTF(idx, pd.parameters, pd.geodesicDirection)
+                end
+            end
+
+            -- r holds J^T(F(x + h v) - F(x) - h J v) ~= 0.5 h^2 J^T r_vv.
+            -- Sets up PCG for (J'J + C'C) a = -J^T r_vv, reusing the diagonal of the velocity solve
+            terra kernels.PCGInitGeodesic(pd : PlanData)
+                var d = opt_float(0.0f)
+                var idx : Index
+                if idx:initFromCUDAParams() and not fmap.exclude(idx,pd.parameters) then
+                    var h = opt_float(pd.solverparameters.geodesic_step_size)
+                    var residuum = (opt_float(-2.0f)/(h*h))*pd.r(idx)
+                    pd.r(idx) = residuum
+                    pd.b(idx) = residuum
+                    pd.delta(idx) = opt_float(0.0f)
+                    var p = pd.preconditioner(idx)*residuum
+                    pd.p(idx) = p
+                    d = residuum:dot(p)
+                end
+                unknownWideReduction(idx,d,pd.scanAlphaNumerator)
+            end
+
+            terra kernels.computeGeodesicNorms(pd : PlanData)
+                var aa = opt_float(0.0f)
+                var vv = opt_float(0.0f)
+                var idx : Index
+                if idx:initFromCUDAParams() and not fmap.exclude(idx,pd.parameters) then
+                    var D = pd.CtC(idx)
+                    var a = pd.delta(idx)
+                    var v = pd.velocity(idx)
+                    aa = (D*a):dot(a)
+                    vv = (D*v):dot(v)
+                end
+                unknownWideReduction(idx,aa,pd.geodesicNorms)
+                unknownWideReduction(idx,vv,pd.geodesicNorms+1)
+            end
+
+            terra kernels.applyGeodesicCorrection(pd : PlanData)
+                var idx : Index
+                if idx:initFromCUDAParams() and not fmap.exclude(idx,pd.parameters) then
+                    pd.delta(idx) = pd.velocity(idx) + pd.geodesicWeight*pd.delta(idx)
+                end
+            end
+
+            if problemSpec.exacthessian then
+                terra kernels.PCGSteihaugDots(pd : PlanData)
+                    var dd = opt_float(0.0f)
+                    var dp = opt_float(0.0f)
+                    var pp = opt_float(0.0f)
+                    var idx : Index
+                    if idx:initFromCUDAParams() and not fmap.exclude(idx,pd.parameters) then
+                        var d = pd.delta(idx)
+                        var p = pd.p(idx)
+                        dd = d:dot(d)
+                        dp = d:dot(p)
+                        pp = p:dot(p)
+                    end
+                    unknownWideReduction(idx,dd,pd.steihaugDots)
+                    unknownWideReduction(idx,dp,pd.steihaugDots+1)
+                    unknownWideReduction(idx,pp,pd.steihaugDots+2)
+                end
+
+                terra kernels.PCGSteihaugStep(pd : PlanData)
+                    var idx : Index
+                    if idx:initFromCUDAParams() and not fmap.exclude(idx,pd.parameters) then
+                        pd.delta(idx) = pd.delta(idx) + pd.steihaugTau*pd.p(idx)
+                    end
+                end
+            end
+
+            if K > 0 then
+                -- pd.r holds -J'F and pd.CtC the unclamped diagonal, sets up one PCG solve per candidate radius
+                terra kernels.specInit(pd : PlanData)
+                    var d : opt_float[SPEC_K]
+                    for k = 0,K do d[k] = opt_float(0.0f) end
+                    var idx : Index
+                    if idx:initFromCUDAParams() and not fmap.exclude(idx,pd.parameters) then
+                        var unclampedCtC = pd.CtC(idx)
+                        var residuum = pd.r(idx)
+                        pd.b(idx) = residuum
+                        for k = 0,K do
+                            var CtC, pre = lmDiagonal(pd, idx, unclampedCtC, pd.specRadius[k])
+                            pre = maskLocal(pd,pre)
+                            pd.specCtC[k](idx) = CtC
+                            pd.specPre[k](idx) = pre
+                            pd.specDelta[k](idx) = opt_float(0.0f)
+                            pd.specR[k](idx) = residuum
+                            var p = pre*residuum
+                            pd.specP[k](idx) = p
+                            d[k] = residuum:dot(p)
+                        end
+                    end
+                    for k = 0,K do
+                        unknownWideReduction(idx,d[k],pd.specReductions + SPEC_ALPHA_NUM*K + k)
+                    end
+                end
+
+                terra kernels.specStep1(pd : PlanData)
+                    var d : opt_float[SPEC_K]
+                    for k = 0,K do d[k] = opt_float(0.0f) end
+                    var idx : Index
+                    if idx:initFromCUDAParams() and not fmap.exclude(idx,pd.parameters) then
+                        escape
+                            local jtjp = specSymbols(unknownElement)
+                            emit quote
+                                var [jtjp] = fmap.applyJTJMulti(idx, pd.parameters, [specImages(pd,"specP")])
+                            end
+                            for k = 0,K-1 do
+                                emit quote
+                                    var Ap = [jtjp[k+1]] + pd.specCtC[k](idx)*pd.specP[k](idx)
+                                    pd.specAp[k](idx) = Ap
+                                    d[k] = pd.specP[k](idx):dot(Ap)
+                                end
+                            end
+                        end
+                    end
+                    for k = 0,K do
+                        unknownWideReduction(idx,d[k],pd.specReductions + SPEC_ALPHA_DEN*K + k)
+                    end
+                end
+
+                terra kernels.specStep2(pd : PlanData)
+                    var betaNum : opt_float[SPEC_K]
+                    var q : opt_float[SPEC_K]
+                    for k = 0,K do
+                        betaNum[k] = opt_float(0.0f)
+                        q[k] = opt_float(0.0f)
+                    end
+                    var idx : Index
+                    if idx:initFromCUDAParams() and not fmap.exclude(idx,pd.parameters) then
+                        var b = pd.b(idx)
+                        for k = 0,K do
+                            var alphaDenominator : opt_float = pd.specReductions[SPEC_ALPHA_DEN*K + k]
+                            var alphaNumerator : opt_float = pd.specReductions[SPEC_ALPHA_NUM*K + k]
+                            var alpha = opt_float(0.0f)
+                            if (not [guardDivisionByZero]) or alphaDenominator > opt_float(0.0f) then
+                                alpha = alphaNumerator/alphaDenominator 
+                            end
+                            var delta = pd.specDelta[k](idx)+alpha*pd.specP[k](idx)
+                            pd.specDelta[k](idx) = delta
+                            var r = pd.specR[k](idx)-alpha*pd.specAp[k](idx)
+                            pd.specR[k](idx) = r
+
+                            var pre = pd.specPre[k](idx)
+                            if not problemSpec.usepreconditioner then
+                                pre = opt_float(1.0f)
+                            end
+                            pre = maskLocal(pd,pre)
+                            var z = pre*r
+                            pd.specZ[k](idx) = z
+                            betaNum[k] = z:dot(r)
+                            q[k] = 0.5*(delta:dot(r + b))
+                        end
+                    end
+                    for k = 0,K do
+                        unknownWideReduction(idx,betaNum[k],pd.specReductions + SPEC_BETA_NUM*K + k)
+                        unknownWideReduction(idx,q[k],pd.specReductions + SPEC_Q*K + k)
+                    end
+                end
+
+                terra kernels.specStep3(pd : PlanData)
+                    var idx : Index
+                    if idx:initFromCUDAParams() and not fmap.exclude(idx,pd.parameters) then
+                        for k = 0,K do
+                            var rDotzNew : opt_float = pd.specReductions[SPEC_BETA_NUM*K + k]
+                            var rDotzOld : opt_float = pd.specReductions[SPEC_ALPHA_NUM*K + k]
+                            var beta : opt_float = opt_float(0.0f)
+                            if (not [guardDivisionByZero]) or rDotzOld > opt_float(0.0f) then
+                                beta = rDotzNew/rDotzOld
+                            end
+                            pd.specP[k](idx) = pd.specZ[k](idx)+beta*pd.specP[k](idx)
+                        end
+                    end
+                end
+
+                terra kernels.specCost(pd : PlanData)
+                    var cost : opt_float[SPEC_K]
+                    for k = 0,K do cost[k] = opt_float(0.0f) end
+                    var idx : Index
+                    if idx:initFromCUDAParams() and not fmap.exclude(idx,pd.parameters) then
+                        escape
+                            local costs = specSymbols(opt_float)
+                            emit quote
+                                var [costs] = fmap.speculativecost(idx, pd.parameters, [specImages(pd,"specDelta")])
+                            end
+                            for k = 0,K-1 do
+                                emit quote cost[k] = [costs[k+1]] end
+                            end
+                        end
+                    end
+                    for k = 0,K do
+                        unknownWideReduction(idx,cost[k],pd.specReductions + SPEC_COST*K + k)
+                    end
+                end
+
+                terra kernels.specModelCost(pd : PlanData)
+                    var cost : opt_float[SPEC_K]
+                    for k = 0,K do cost[k] = opt_float(0.0f) end
+                    var idx : Index
+                    if idx:initFromCUDAParams() and not fmap.exclude(idx,pd.parameters) then
+                        for k = 0,K do
+                            cost[k] = fmap.modelcost(idx, pd.parameters, pd.specDelta[k])
+                        end
+                    end
+                    for k = 0,K do
+                        unknownWideReduction(idx,cost[k],pd.specReductions + SPEC_MODEL_COST*K + k)
+                    end
+                end
+
+                terra kernels.specAccept(pd : PlanData)
+                    var idx : Index
+                    if idx:initFromCUDAParams() and not fmap.exclude(idx,pd.parameters) then
+                        pd.delta(idx) = pd.specDelta[pd.specBest](idx)
+                    end
+                end
+            end
+
         end -- :UsesLambda()
 	    return kernels
 	end
@@ -690,6 +1318,35 @@ return function(problemSpec)
                 fmap.evalJTF(tIdx, pd.parameters, pd.r, pd.preconditioner)
             end
         end    
+
+        if problemSpec.fusedcostjtf then
+            terra kernels.computeCostAndJTF_Graph(pd : PlanData)
+                var cost : opt_float = opt_float(0.0f)
+                var tIdx = 0
+                if util.getValidGraphElement(pd,[graphname],&tIdx) then
+                    escape
+                        if problemSpec:UsesLambda() then
+                            emit quote cost = fmap.evalJTFCost(tIdx, pd.parameters, pd.r, pd.preconditioner, pd.CtC) end
+                        else
+                            emit quote cost = fmap.evalJTFCost(tIdx, pd.parameters, pd.r, pd.preconditioner) end
+                        end
+                    end
+                end
+                cost = util.warpReduce(cost)
+                if (util.laneid() == 0) then
+                    util.atomicAdd(pd.scratch, cost)
+                end
+            end
+        end
+
+        if problemSpec.localunknowns then
+            terra kernels.localSystemInit_Graph(pd : PlanData)
+                var tIdx = 0
+                if util.getValidGraphElement(pd,[graphname],&tIdx) then
+                    fmap.evalLocalSystem(tIdx, pd.parameters, pd.r, pd.Ap_X, pd.z)
+                end
+            end
+        end
         
     	terra kernels.PCGStep1_Graph(pd : PlanData)
             var d = opt_float(0.0f)
@@ -748,12 +1405,83 @@ return function(problemSpec)
                 var tIdx = 0
                 if util.getValidGraphElement(pd,[graphname],&tIdx) then
                     cost = fmap.modelcost(tIdx, pd.parameters, pd.delta)
-                end 
+                end
                 cost = util.warpReduce(cost)
                 if (util.laneid() == 0) then
                     util.atomicAdd(pd.modelCost, cost)
                 end
             end
+
+            terra kernels.computeGeodesicRHS_Graph(pd : PlanData)
+                var tIdx = 0
+                if util.getValidGraphElement(pd,[graphname],&tIdx) then
+                    fmap.evalGeodesicJTF(tIdx, pd.parameters, pd.geodesicDirection, pd.r)
+                end
+            end
+
+            if K > 0 then
+                -- results are per candidate, accumulated into the specReductions slot starting at offset
+                local function graphReduce(pd,values,offset)
+                    return quote
+                        for k = 0,K do
+                            var v = util.warpReduce(values[k])
+                            if (util.laneid() == 0) then
+                                util.atomicAdd(pd.specReductions + offset*K + k, v)
+                            end
+                        end
+                    end
+                end
+
+                terra kernels.specStep1_Graph(pd : PlanData)
+                    var d : opt_float[SPEC_K]
+                    for k = 0,K do d[k] = opt_float(0.0f) end
+                    var tIdx = 0
+                    if util.getValidGraphElement(pd,[graphname],&tIdx) then
+                        escape
+                            local pAp = specSymbols(opt_float)
+                            local args = specImages(pd,"specP")
+                            args:insertall(specImages(pd,"specAp"))
+                            emit quote
+                                var [pAp] = fmap.applyJTJMulti(tIdx, pd.parameters, [args])
+                            end
+                            for k = 0,K-1 do
+                                emit quote d[k] = [pAp[k+1]] end
+                            end
+                        end
+                    end
+                    [graphReduce(pd,d,SPEC_ALPHA_DEN)]
+                end
+
+                terra kernels.specCost_Graph(pd : PlanData)
+                    var cost : opt_float[SPEC_K]
+                    for k = 0,K do cost[k] = opt_float(0.0f) end
+                    var tIdx = 0
+                    if util.getValidGraphElement(pd,[graphname],&tIdx) then
+                        escape
+                            local costs = specSymbols(opt_float)
+                            emit quote
+                                var [costs] = fmap.speculativecost(tIdx, pd.parameters, [specImages(pd,"specDelta")])
+                            end
+                            for k = 0,K-1 do
+                                emit quote cost[k] = [costs[k+1]] end
+                            end
+                        end
+                    end
+                    [graphReduce(pd,cost,SPEC_COST)]
+                end
+
+                terra kernels.specModelCost_Graph(pd : PlanData)
+                    var cost : opt_float[SPEC_K]
+                    for k = 0,K do cost[k] = opt_float(0.0f) end
+                    var tIdx = 0
+                    if util.getValidGraphElement(pd,[graphname],&tIdx) then
+                        for k = 0,K do
+                            cost[k] = fmap.modelcost(tIdx, pd.parameters, pd.specDelta[k])
+                        end
+                    end
+                    [graphReduce(pd,cost,SPEC_MODEL_COST)]
+                end
+            end
         end
 
 	    return kernels
@@ -772,6 +1500,8 @@ return function(problemSpec)
                                                                         "PCGLinearUpdate",
                                                                         "revertUpdate",
                                                                         "savePreviousUnknowns",
+                                                                        "saveBestUnknowns",
+                                                                        "restoreBestUnknowns",
                                                                         "computeCost",
                                                                         "PCGSaveSSq",
                                                                         "precompute",
@@ -784,22 +1514,75 @@ return function(problemSpec)
                                                                         "computeModelCost",
                                                                         "computeModelCost_Graph",
                                                                         "saveJToCRS",
-                                                                        "saveJToCRS_Graph"
+                                                                        "saveJToCRS_Graph",
+                                                                        "saveGeodesicVelocity",
+                                                                        "computeGeodesicRHS",
+                                                                        "computeGeodesicRHS_Graph",
+                                                                        "PCGInitGeodesic",
+                                                                        "computeGeodesicNorms",
+                                                                        "applyGeodesicCorrection",
+                                                                        "andersonUpdateHistory",
+                                                                        "andersonComputeDots",
+                                                                        "andersonMix",
+                                                                        "andersonRevert",
+                                                                        "PCGSteihaugDots",
+                                                                        "PCGSteihaugStep",
+                                                                        "localSystemInit",
+                                                                        "localSystemInit_Graph",
+                                                                        "localSolve",
+                                                                        "specInit",
+                                                                        "specStep1",
+                                                                        "specStep1_Graph",
+                                                                        "specStep2",
+                                                                        "specStep3",
+                                                                        "specCost",
+                                                                        "specCost_Graph",
+                                                                        "specModelCost",
+                                                                        "specModelCost_Graph",
+                                                                        "specAccept",
+                                                                        "computeCostAndJTF",
+                                                                        "computeCostAndJTF_Graph",
+                                                                        "PCGInit1_Fused"
+                                                                        },
+                                                                        -- reduction-only phases, launched as one kernel per phase
+                                                                        { {name="computeCost_Fused", centered="computeCost", graph="computeCost_Graph"},
+                                                                          {name="computeModelCost_Fused", centered="computeModelCost", graph="computeModelCost_Graph"},
+                                                                          {name="specCost_Fused", centered="specCost", graph="specCost_Graph"},
+                                                                          {name="specModelCost_Fused", centered="specModelCost", graph="specModelCost_Graph"}
                                                                         })
 
     local terra computeCost(pd : &PlanData) : opt_float
         C.cudaMemset(pd.scratch, 0, sizeof(opt_float))
-        gpu.computeCost(pd)
-        gpu.computeCost_Graph(pd)
+        gpu.computeCost_Fused(pd)
         var f : opt_float
         C.cudaMemcpy(&f, pd.scratch, sizeof(opt_float), C.cudaMemcpyDeviceToHost)
         return f
     end
 
+    -- computeCost, which with fused evaluation also leaves the start of the next iteration's
+    -- PCGInit1 and PCGComputeCtC work in r, preconditioner and CtC. Callers that then revert
+    -- the unknowns must clear jtfValid
+    local computeCostAndJTF
+    if problemSpec.fusedcostjtf then
+        terra computeCostAndJTF(pd : &PlanData) : opt_float
+            C.cudaMemset(pd.scratch, 0, sizeof(opt_float))
+            gpu.computeCostAndJTF(pd)
+            gpu.computeCostAndJTF_Graph(pd)
+            pd.jtfValid = true
+            escape if problemSpec:UsesLambda() then
+                emit quote pd.jtfRadius = pd.parameters.trust_region_radius end
+            end end
+            var f : opt_float
+            C.cudaMemcpy(&f, pd.scratch, sizeof(opt_float), C.cudaMemcpyDeviceToHost)
+            return f
+        end
+    else
+        computeCostAndJTF = computeCost
+    end
+
     local terra computeModelCost(pd : &PlanData) : opt_float
         C.cudaMemset(pd.modelCost, 0, sizeof(opt_float))
-        gpu.computeModelCost(pd)
-        gpu.computeModelCost_Graph(pd)
+        gpu.computeModelCost_Fused(pd)
         var f : opt_float
         C.cudaMemcpy(&f, pd.modelCost, sizeof(opt_float), C.cudaMemcpyDeviceToHost)
         return f
@@ -953,11 +1736,430 @@ return function(problemSpec)
         terra cusparseOuter(pd : &PlanData) end
     end
 
+    -- With UseExactHessian the system may be indefinite. Called after PCGStep1, this truncates the
+    -- solve at the boundary |delta| = steihaugRadius when the curvature p'Ap is not positive or
+    -- the next iterate would leave the region (Steihaug). Returns true if the solve was truncated
+    local terra steihaugTruncate(pd : &PlanData) : bool
+        var alphaNumerator : opt_float
+        var alphaDenominator : opt_float
+        C.cudaMemcpy(&alphaNumerator, pd.scanAlphaNumerator, sizeof(opt_float), C.cudaMemcpyDeviceToHost)
+        C.cudaMemcpy(&alphaDenominator, pd.scanAlphaDenominator, sizeof(opt_float), C.cudaMemcpyDeviceToHost)
+
+        C.cudaMemset(pd.steihaugDots, 0, 3*sizeof(opt_float))
+        gpu.PCGSteihaugDots(pd)
+        var dots : opt_float[3]
+        C.cudaMemcpy(&dots, pd.steihaugDots, 3*sizeof(opt_float), C.cudaMemcpyDeviceToHost)
+        var dd,dp,pp = dots[0],dots[1],dots[2]
+        if pp <= 0.0 then
+            return false
+        end
+
+        var radius2 = pd.steihaugRadius*pd.steihaugRadius
+        var truncate = alphaDenominator <= 0.0
+        if not truncate then
+            var alpha = alphaNumerator/alphaDenominator
+            truncate = dd + 2.0*alpha*dp + alpha*alpha*pp >= radius2
+        end
+        if not truncate then
+            return false
+        end
+        -- positive root of |delta + tau p|^2 = radius^2
+        var disc = util.cpuMath.fmax(dp*dp + pp*(radius2 - dd), 0.0)
+        pd.steihaugTau = (sqrtf(disc) - dp)/pp
+        gpu.PCGSteihaugStep(pd)
+        pd.steihaugHitBoundary = true
+        logSolver(" steihaug: truncated at radius %f (p'Ap = %g)\n", pd.steihaugRadius, alphaDenominator)
+        return true
+    end
+
+    -- Runs the inner PCG iterations on the system set up by the caller, returns the number of iterations taken
+    local terra linearSolve(pd : &PlanData, Q0 : opt_float) : int
+        var residual_reset_period : int = pd.solverparameters.residual_reset_period
+        var q_tolerance : opt_float     = pd.solverparameters.q_tolerance
+        var Q1 : opt_float
+        for lIter = 0, pd.linearIterations do				
+            pd.linearIterationsRun = lIter + 1
+
+            C.cudaMemset(pd.scanAlphaDenominator, 0, sizeof(opt_float))
+            C.cudaMemset(pd.q, 0, sizeof(opt_float))
+
+            if not initialization_parameters.use_cusparse then
+    				gpu.PCGStep1(pd)
+    				if isGraph then
+    					gpu.PCGStep1_Graph(pd)
+    				end
+            end
+
+				-- only does anything if initialization_parameters.use_cusparse is true
+            cusparseInner(pd)
+
+            escape if multistep_alphaDenominator_compute then emit quote
+                gpu.PCGStep1_Finish(pd)
+            end end end
+            if [problemSpec.exacthessian] and steihaugTruncate(pd) then
+                return lIter+1
+            end
+				logDebugCudaOptFloat("scanAlphaDenominator", pd.scanAlphaDenominator)
+				C.cudaMemset(pd.scanBetaNumerator, 0, sizeof(opt_float))
+				
+				-- the residual reset kernels only exist for LM, keep them out of Gauss-Newton's step entirely
+				var resetResidual = false
+				escape if problemSpec:UsesLambda() then emit quote
+					resetResidual = ((lIter + 1) % residual_reset_period) == 0
+					if resetResidual then
+                        gpu.PCGStep2_1stHalf(pd)
+                        gpu.computeAdelta(pd)
+                        if isGraph then
+                            gpu.computeAdelta_Graph(pd)
+                        end
+                        gpu.PCGStep2_2ndHalf(pd)
+                    end
+				end end end
+            if not resetResidual then
+                gpu.PCGStep2(pd)
+            end
+            logDebugCudaOptFloat("scanBetaNumerator", pd.scanBetaNumerator)
+            gpu.PCGStep3(pd)
+
+				-- save new rDotz for next iteration
+				C.cudaMemcpy(pd.scanAlphaNumerator, pd.scanBetaNumerator, sizeof(opt_float), C.cudaMemcpyDeviceToDevice)	
+				
+				if [problemSpec:UsesLambda()] then
+	                Q1 = fetchQ(pd)
+	                var zeta = [opt_float](lIter+1)*(Q1 - Q0) / Q1 
+                --logSolver("%d: Q0(%g) Q1(%g), zeta(%g)\n", lIter, Q0, Q1, zeta)
+	                if zeta < q_tolerance then
+                    logSolver("zeta=%.18g, breaking at iteration: %d\n", zeta, (lIter+1))
+	                    return lIter+1
+	                end
+	                Q0 = Q1
+				end
+        end
+        return pd.linearIterations
+    end
+
+    local geodesicAcceleration
+    if problemSpec:UsesLambda() then
+        -- Geodesic acceleration (Transtrum & Sethna): delta holds the LM velocity v on entry.
+        -- Solves (J'J + C'C) a = -J' r_vv with r_vv from a finite difference along v,
+        -- and replaces delta with v + 0.5*a if the correction is small relative to v
+        terra geodesicAcceleration(pd : &PlanData)
+            if not pd.geodesicAllocated then
+                pd.velocity:initGPU()
+                pd.geodesicDirection:initGPU()
+                C.cudaMalloc([&&opaque](&(pd.geodesicNorms)), 2*sizeof(opt_float))
+                pd.geodesicAllocated = true
+            end
+            gpu.saveGeodesicVelocity(pd)
+            gpu.computeGeodesicRHS(pd)
+            gpu.computeGeodesicRHS_Graph(pd)
+
+            C.cudaMemset(pd.scanAlphaNumerator, 0, sizeof(opt_float))
+            C.cudaMemset(pd.q, 0, sizeof(opt_float))
+            gpu.PCGInitGeodesic(pd)
+            var lIters = linearSolve(pd, 0.0)
+
+            C.cudaMemset(pd.geodesicNorms, 0, 2*sizeof(opt_float))
+            gpu.computeGeodesicNorms(pd)
+            var norms : opt_float[2]
+            C.cudaMemcpy(&norms, pd.geodesicNorms, 2*sizeof(opt_float), C.cudaMemcpyDeviceToHost)
+
+            pd.geodesicWeight = 0.0
+            if norms[1] > 0.0 then
+                var ratio = 2.0*sqrtf(norms[0]/norms[1])
+                logSolver(" geodesic ratio=%f (%d linear iterations)\n", ratio, lIters)
+                if ratio <= pd.solverparameters.geodesic_acceptance_ratio then
+                    pd.geodesicWeight = 0.5
+                end
+            end
+            gpu.applyGeodesicCorrection(pd)
+        end
+    end
+
+    -- Solves the regularized normal equations (DF'DF + mu I) gamma = DF'f by Cholesky on the host
+    local terra andersonSolveGamma(pd : &PlanData) : bool
+        var M = ANDERSON_MAX_DEPTH
+        var m = pd.andersonHistory
+        var dots : opt_float[ANDERSON_MAX_DEPTH*ANDERSON_MAX_DEPTH + ANDERSON_MAX_DEPTH]
+        C.cudaMemcpy(&dots, pd.andersonDots, (M*M + M)*sizeof(opt_float), C.cudaMemcpyDeviceToHost)
+
+        var maxDiagonal = 0.0
+        for i = 0,m do
+            maxDiagonal = C.fmax(maxDiagonal, dots[i*M+i])
+        end
+        if maxDiagonal <= 0.0 then
+            return false
+        end
+        var L : double[ANDERSON_MAX_DEPTH*ANDERSON_MAX_DEPTH]
+        for j = 0,m do
+            var s : double = dots[j*M+j] + 1e-10*maxDiagonal
+            for k = 0,j do
+                s = s - L[j*M+k]*L[j*M+k]
+            end
+            if s <= 0.0 then
+                return false
+            end
+            L[j*M+j] = C.sqrt(s)
+            for i = j+1,m do
+                var t : double = dots[j*M+i] -- upper triangle holds DF_j'DF_i
+                for k = 0,j do
+                    t = t - L[i*M+k]*L[j*M+k]
+                end
+                L[i*M+j] = t / L[j*M+j]
+            end
+        end
+        var z : double[ANDERSON_MAX_DEPTH]
+        for i = 0,m do
+            var t : double = dots[M*M+i]
+            for k = 0,i do
+                t = t - L[i*M+k]*z[k]
+            end
+            z[i] = t / L[i*M+i]
+        end
+        for ii = 0,m do
+            var i = m - 1 - ii
+            var t = z[i]
+            for k = i+1,m do
+                t = t - L[k*M+i]*pd.andersonGamma[k]
+            end
+            pd.andersonGamma[i] = t / L[i*M+i]
+        end
+        return true
+    end
+
+    -- Anderson acceleration of the fixed point iteration x_{k+1} = x_k + f_k, where f_k is the accepted step.
+    -- Called after an accepted step, with x_k in prevX, f_k in delta and x_k + f_k in X.
+    -- The mixed iterate is kept only if it lowers the cost.
+    local terra andersonAccelerate(pd : &PlanData)
+        var depth = pd.solverparameters.anderson_depth
+        if depth > ANDERSON_MAX_DEPTH then
+            depth = ANDERSON_MAX_DEPTH
+        end
+        if pd.andersonAllocatedDepth == 0 then
+            pd.andersonPrevX:initGPU()
+            pd.andersonPrevF:initGPU()
+            pd.andersonBackup:initGPU()
+            C.cudaMalloc([&&opaque](&(pd.andersonDots)), (ANDERSON_MAX_DEPTH*ANDERSON_MAX_DEPTH + ANDERSON_MAX_DEPTH)*sizeof(opt_float))
+        end
+        for i = pd.andersonAllocatedDepth,depth do
+            pd.andersonDX[i]:initGPU()
+            pd.andersonDF[i]:initGPU()
+        end
+        if depth > pd.andersonAllocatedDepth then
+            pd.andersonAllocatedDepth = depth
+        end
+
+        if pd.andersonIterates > 0 then
+            pd.andersonSlot = (pd.andersonIterates - 1) % depth
+        end
+        gpu.andersonUpdateHistory(pd)
+        pd.andersonIterates = pd.andersonIterates + 1
+
+        pd.andersonHistory = pd.andersonIterates - 1
+        if pd.andersonHistory > depth then
+            pd.andersonHistory = depth
+        end
+        if pd.andersonHistory == 0 then
+            return
+        end
+
+        C.cudaMemset(pd.andersonDots, 0, (ANDERSON_MAX_DEPTH*ANDERSON_MAX_DEPTH + ANDERSON_MAX_DEPTH)*sizeof(opt_float))
+        gpu.andersonComputeDots(pd)
+        if not andersonSolveGamma(pd) then
+            return
+        end
+
+        gpu.andersonMix(pd)
+        gpu.precompute(pd)
+        var mixedCost = computeCostAndJTF(pd)
+        if mixedCost < pd.prevCost then
+            logSolver(" anderson: cost %f -> %f\n", pd.prevCost, mixedCost)
+            pd.prevCost = mixedCost
+        else
+            logSolver(" anderson: rejected mixed cost %f\n", mixedCost)
+            gpu.andersonRevert(pd)
+            pd.jtfValid = false
+            gpu.precompute(pd)
+        end
+    end
+
+    -- Local half of the alternating solve: updates the local unknowns in closed form with the
+    -- others fixed, keeping the update only if it lowers the cost. The global PCG solve that follows
+    -- is masked so it only moves the remaining unknowns
+    local terra localStep(pd : &PlanData)
+        gpu.localSystemInit(pd)
+        gpu.localSystemInit_Graph(pd)
+        gpu.savePreviousUnknowns(pd)
+        gpu.localSolve(pd)
+        gpu.precompute(pd)
+        var newCost = computeCostAndJTF(pd)
+        if newCost < pd.prevCost then
+            logSolver(" local step: cost %f -> %f\n", pd.prevCost, newCost)
+            pd.prevCost = newCost
+        else
+            logSolver(" local step: rejected cost %f\n", newCost)
+            gpu.revertUpdate(pd)
+            pd.jtfValid = false
+            gpu.precompute(pd)
+        end
+    end
+
+    local speculativeStep
+    if K > 0 then
+        -- LMSpeculativeGPU: runs the PCG solves for the next K radii the serial LM loop would try
+        -- (each rejection divides the radius by a doubling decrease factor) in the same kernels,
+        -- then accepts the candidate with the largest cost decrease. Fills in the iteration's statistics
+        -- like the serial loop does, and returns false when the solve should stop
+        terra speculativeStep(pd : &PlanData, stats : &opt.IterationStatistics, iterationStart : double) : bool
+            var radius : opt_float = pd.parameters.trust_region_radius
+            var decrease : opt_float = pd.parameters.radius_decrease_factor
+            for k = 0,K do
+                pd.specRadius[k] = radius
+                radius = radius / decrease
+                decrease = 2.0 * decrease
+            end
+            C.cudaMemset(pd.specReductions, 0, SPEC_SLOTS*K*sizeof(opt_float))
+            gpu.specInit(pd)
+
+            var Q0 : opt_float[SPEC_K]
+            var Q1 : opt_float[SPEC_K]
+            for k = 0,K do Q0[k] = 0.0 end
+            for lIter = 0, pd.linearIterations do
+                pd.linearIterationsRun = lIter + 1
+                -- alpha denominators, beta numerators and Q are contiguous
+                C.cudaMemset(pd.specReductions + SPEC_ALPHA_DEN*K, 0, 3*K*sizeof(opt_float))
+                gpu.specStep1(pd)
+                gpu.specStep1_Graph(pd)
+                gpu.specStep2(pd)
+                gpu.specStep3(pd)
+                -- save new rDotz for next iteration
+                C.cudaMemcpy(pd.specReductions + SPEC_ALPHA_NUM*K, pd.specReductions + SPEC_BETA_NUM*K, K*sizeof(opt_float), C.cudaMemcpyDeviceToDevice)
+                C.cudaMemcpy(&Q1, pd.specReductions + SPEC_Q*K, K*sizeof(opt_float), C.cudaMemcpyDeviceToHost)
+                var converged = true
+                for k = 0,K do
+                    var zeta = [opt_float](lIter+1)*(Q1[k] - Q0[k]) / Q1[k]
+                    converged = converged and zeta < pd.solverparameters.q_tolerance
+                    Q0[k] = Q1[k]
+                end
+                if converged then
+                    logSolver("zeta below tolerance for all candidates, breaking at iteration: %d\n", (lIter+1))
+                    break
+                end
+            end
+            stats.linearIterations = pd.linearIterationsRun
+            var linearEnd = util.clock.opt_clock_ms()
+            stats.linearMs = linearEnd - iterationStart
+
+            gpu.specCost_Fused(pd)
+            gpu.specModelCost_Fused(pd)
+            var reductions : opt_float[SPEC_SLOTS*SPEC_K]
+            C.cudaMemcpy(&reductions, pd.specReductions, SPEC_SLOTS*K*sizeof(opt_float), C.cudaMemcpyDeviceToHost)
+
+            var best = -1
+            var best_change : opt_float = 0.0
+            var best_quality : opt_float = 0.0
+            for k = 0,K do
+                var cost_change = pd.prevCost - reductions[SPEC_COST*K + k]
+                var model_cost_change = pd.prevCost - reductions[SPEC_MODEL_COST*K + k]
+                var relative_decrease = cost_change / model_cost_change
+                logSolver(" candidate %d: radius=%f cost=%f relative_decrease=%f\n", k, pd.specRadius[k], reductions[SPEC_COST*K + k], relative_decrease)
+                if cost_change >= 0 and relative_decrease > pd.solverparameters.min_relative_decrease and (best < 0 or cost_change > best_change) then
+                    best = k
+                    best_change = cost_change
+                    best_quality = relative_decrease
+                end
+            end
+
+            -- the serial loop would report the last radius it tried, i.e. the smallest one when all are rejected
+            var reported = best
+            if best < 0 then
+                reported = K - 1
+            end
+            stats.accepted = int(best >= 0)
+            stats.modelCost = reductions[SPEC_MODEL_COST*K + reported]
+            stats.linearResidual = reductions[SPEC_ALPHA_NUM*K + reported]
+
+            if best < 0 then
+                stats.evaluateMs = util.clock.opt_clock_ms() - linearEnd
+                -- continue from the radius the serial loop would reach after K rejections
+                pd.parameters.trust_region_radius = radius
+                pd.parameters.radius_decrease_factor = decrease
+                logSolver(" trust_region_radius=%f \n", pd.parameters.trust_region_radius)
+                if pd.parameters.trust_region_radius <= pd.solverparameters.min_trust_region_radius then
+                    logSolver("\nTrust_region_radius is less than the min, exiting\n")
+                    return false
+                end
+                logSolver("REVERT\n")
+                return true
+            end
+
+            pd.specBest = best
+            gpu.specAccept(pd)
+            gpu.savePreviousUnknowns(pd)
+            gpu.PCGLinearUpdate(pd)
+            gpu.precompute(pd)
+            stats.evaluateMs = util.clock.opt_clock_ms() - linearEnd
+            logSolver(" accepted candidate %d: cost %f -> %f\n", best, pd.prevCost, reductions[SPEC_COST*K + best])
+            var tolerance = pd.prevCost * pd.solverparameters.function_tolerance
+            pd.prevCost = reductions[SPEC_COST*K + best]
+            if best_change <= tolerance then
+                logSolver("\nFunction tolerance reached, exiting\n")
+                return false
+            end
+
+            var min_factor = 1.0/3.0
+            var tmp_factor = 1.0 - util.cpuMath.pow(2.0 * best_quality - 1.0, 3.0)
+            pd.parameters.trust_region_radius = pd.specRadius[best] / util.cpuMath.fmax(min_factor, tmp_factor)
+            pd.parameters.trust_region_radius = util.cpuMath.fmin(pd.parameters.trust_region_radius, pd.solverparameters.max_trust_region_radius)
+            pd.parameters.radius_decrease_factor = 2.0
+            if pd.solverparameters.anderson_depth > 0 then
+                andersonAccelerate(pd)
+            end
+            return true
+        end
+    end
+
+    -- the unknown-shaped temporaries, borrowed as one block per solve when sharedSolverScratch is set
+    local scratchvectors = {"delta","r","b","Adelta","z","p","Ap_X","CtC","SSq","preconditioner","g","prevX"}
+    local terra acquireScratch(pd : &PlanData)
+        if pd.scratchData == nil then
+            var vectorbytes = pd.delta:totalbytes()
+            pd.scratchBytes = [#scratchvectors]*vectorbytes
+            pd.scratchData = util.scratcharena:acquire(pd.scratchBytes)
+            cd(C.cudaMemset(pd.scratchData, 0, pd.scratchBytes))
+            escape
+                for i,name in ipairs(scratchvectors) do
+                    emit quote pd.[name]:initFromGPUptr(pd.scratchData + [i-1]*vectorbytes) end
+                end
+            end
+        end
+    end
+    local terra releaseScratch(pd : &PlanData)
+        if pd.scratchData ~= nil then
+            escape
+                for _,name in ipairs(scratchvectors) do
+                    emit quote pd.[name]:detach() end
+                end
+            end
+            util.scratcharena:release(pd.scratchData, pd.scratchBytes)
+            pd.scratchData = nil
+        end
+    end
+
 	local terra init(data_ : &opaque, params_ : &&opaque)
 	   var pd = [&PlanData](data_)
+	   escape if _opt_shared_scratch then emit quote acquireScratch(pd) end end end
+	   pd.solveStartMs = util.clock.opt_clock_ms()
+	   pd.statistics:clear()
+	   for i = 0,5 do pd.budgetFit[i] = 0.0 end
 	   pd.timer:init()
 	   pd.timer:startEvent("overall",nil,&pd.endSolver)
-       [util.initParameters(`pd.parameters,problemSpec,params_,true)]
+       if params_ == nil then
+           params_ = &pd.bound[0]
+           [util.initParameters(`pd.parameters,problemSpec,params_,false)]
+       else
+           [util.initParameters(`pd.parameters,problemSpec,params_,true)]
+       end
        var [parametersSym] = &pd.parameters
         escape if initialization_parameters.use_cusparse then emit quote
             if pd.J_csrValA == nil then
@@ -992,6 +2194,7 @@ return function(problemSpec)
         end end end
 
 	   pd.solverparameters.nIter = 0
+	   pd.andersonIterates = 0
        escape 
             if problemSpec:UsesLambda() then
               emit quote 
@@ -999,11 +2202,23 @@ return function(problemSpec)
                 pd.parameters.radius_decrease_factor    = pd.solverparameters.radius_decrease_factor
                 pd.parameters.min_lm_diagonal           = pd.solverparameters.min_lm_diagonal
                 pd.parameters.max_lm_diagonal           = pd.solverparameters.max_lm_diagonal
+                pd.steihaugRadius                       = pd.solverparameters.steihaug_radius
               end
 	        end 
        end
 	   gpu.precompute(pd)
-	   pd.prevCost = computeCost(pd)
+	   pd.jtfValid = false
+	   pd.prevCost = computeCostAndJTF(pd)
+	   pd.costEpoch = pd.parameterEpoch
+	   pd.budgetActive = pd.solverparameters.time_budget_ms > 0
+	   if pd.budgetActive then
+	       if not pd.bestAllocated then
+	           pd.bestX:initGPU()
+	           pd.bestAllocated = true
+	       end
+	       gpu.saveBestUnknowns(pd)
+	       pd.bestCost = pd.prevCost
+	   end
 	end
 
 	local terra cleanup(pd : &PlanData)
@@ -1013,26 +2228,76 @@ return function(problemSpec)
         pd.timer:cleanup()
     end
 
-	local terra step(data_ : &opaque, params_ : &&opaque)
+    -- r'z left by the last linear solve, the copy also waits for the solve to finish
+    local terra fetchLinearResidual(pd : &PlanData) : opt_float
+        var r : opt_float
+        C.cudaMemcpy(&r, pd.scanAlphaNumerator, sizeof(opt_float), C.cudaMemcpyDeviceToHost)
+        return r
+    end
+
+    local terra refreshCost(pd : &PlanData)
+        gpu.precompute(pd)
+        pd.prevCost = computeCost(pd)
+        pd.jtfValid = false
+        pd.costEpoch = pd.parameterEpoch
+    end
+
+    -- appends the iteration's statistics and runs the iteration callback, true if the callback asked to stop.
+    -- Scalar parameters are read through their pointers at the start of each iteration, so the callback
+    -- can change them; it reports that so the next iteration, or a cost query after the solve, re-evaluates
+    -- the baseline cost. The values are read here, while params_ is certainly still valid
+    local terra recordIteration(pd : &PlanData, params_ : &&opaque, stats : &opt.IterationStatistics, iterationStart : double) : bool
+        stats.cost = pd.prevCost
+        escape if problemSpec:UsesLambda() then emit quote
+            stats.trustRegionRadius = pd.parameters.trust_region_radius
+        end end end
+        stats.totalMs = util.clock.opt_clock_ms() - iterationStart
+        pd.statistics:insert(@stats)
+        if pd.plan.callback == nil then
+            return false
+        end
+        var request = pd.plan.callback(stats, pd.statistics:size() - 1, pd.plan.callbackdata)
+        if (request and opt.ITERATION_PARAMETERS_CHANGED) ~= 0 then
+            [util.initParameters(`pd.parameters,problemSpec,params_,false)]
+            pd.parameterEpoch = pd.parameterEpoch + 1
+        end
+        return (request and opt.ITERATION_STOP) ~= 0
+    end
+
+	local terra iterate(data_ : &opaque, params_ : &&opaque)
         var pd = [&PlanData](data_)
-        var residual_reset_period : int         = pd.solverparameters.residual_reset_period
         var min_relative_decrease : opt_float   = pd.solverparameters.min_relative_decrease
         var min_trust_region_radius : opt_float = pd.solverparameters.min_trust_region_radius
         var max_trust_region_radius : opt_float = pd.solverparameters.max_trust_region_radius
-        var q_tolerance : opt_float             = pd.solverparameters.q_tolerance
         var function_tolerance : opt_float      = pd.solverparameters.function_tolerance
         var Q0 : opt_float
-        var Q1 : opt_float
 		[util.initParameters(`pd.parameters,problemSpec, params_,false)]
+		if pd.costEpoch ~= pd.parameterEpoch then
+			refreshCost(pd) -- parameters changed since the last step, which invalidates the step's baseline cost
+		end
 		if pd.solverparameters.nIter < pd.solverparameters.nIterations then
+            var iterationStart = util.clock.opt_clock_ms()
+            var stats : opt.IterationStatistics
+            stats.modelCost,stats.trustRegionRadius,stats.linearResidual = 0.0,0.0,0.0
+            stats.linearMs,stats.evaluateMs,stats.linearIterations,stats.accepted = 0.0,0.0,0,1
+            if [problemSpec.localunknowns ~= nil] and pd.solverparameters.eliminate_local_unknowns ~= 0 then
+                localStep(pd)
+            end
 			C.cudaMemset(pd.scanAlphaNumerator, 0, sizeof(opt_float))	--scan in PCGInit1 requires reset
 			C.cudaMemset(pd.scanAlphaDenominator, 0, sizeof(opt_float))	--scan in PCGInit1 requires reset
 			C.cudaMemset(pd.scanBetaNumerator, 0, sizeof(opt_float))	--scan in PCGInit1 requires reset
 
-			gpu.PCGInit1(pd)
-			if isGraph then
-				gpu.PCGInit1_Graph(pd)	
-				gpu.PCGInit1_Finish(pd)	
+			-- the PCG solve overwrites r, preconditioner and CtC, so cached evalJTFCost results are used at most once
+			var jtfCached = pd.jtfValid
+			pd.jtfValid = false
+			if jtfCached then
+				gpu.PCGInit1_Fused(pd)
+			else
+				gpu.PCGInit1(pd)
+				if isGraph then
+					gpu.PCGInit1_Graph(pd)	
+					gpu.PCGInit1_Finish(pd)	
+				end
 			end
 
             escape 
@@ -1043,8 +2308,25 @@ return function(problemSpec)
                         if [initialization_parameters.jacobiScaling == JacobiScalingType.ONCE_PER_SOLVE] and pd.solverparameters.nIter == 0 then
                             gpu.PCGSaveSSq(pd)
                         end
-                        gpu.PCGComputeCtC(pd)
-                        gpu.PCGComputeCtC_Graph(pd)
+                        if not jtfCached then
+                            gpu.PCGComputeCtC(pd)
+                            gpu.PCGComputeCtC_Graph(pd)
+                        end
+                        escape if K > 0 then emit quote
+                            var more = speculativeStep(pd, &stats, iterationStart)
+                            var stop = recordIteration(pd, params_, &stats, iterationStart)
+                            if not more then
+                                cleanup(pd)
+                                return 0
+                            end
+                            pd.solverparameters.nIter = pd.solverparameters.nIter + 1
+                            if stop then
+                                logSolver("\nStopped by the iteration callback\n")
+                                cleanup(pd)
+                                return 0
+                            end
+                            return 1
+                        end end end
                         -- This also computes Q
                         gpu.PCGFinalizeDiagonal(pd)
                         Q0 = fetchQ(pd)
@@ -1053,68 +2335,40 @@ return function(problemSpec)
             end
             logDebugCudaOptFloat("init scanAlphaNumerator", pd.scanAlphaNumerator)
             cusparseOuter(pd)
-            for lIter = 0, pd.solverparameters.lIterations do				
-
-                C.cudaMemset(pd.scanAlphaDenominator, 0, sizeof(opt_float))
-                C.cudaMemset(pd.q, 0, sizeof(opt_float))
+            pd.steihaugHitBoundary = false
+            stats.linearIterations = linearSolve(pd, Q0)
 
-                if not initialization_parameters.use_cusparse then
-    				gpu.PCGStep1(pd)
-    				if isGraph then
-    					gpu.PCGStep1_Graph(pd)
-    				end
-                end
-
-				-- only does anything if initialization_parameters.use_cusparse is true
-                cusparseInner(pd)
-
-                if multistep_alphaDenominator_compute then
-                    gpu.PCGStep1_Finish(pd)
-                end
-				logDebugCudaOptFloat("scanAlphaDenominator", pd.scanAlphaDenominator)
-				C.cudaMemset(pd.scanBetaNumerator, 0, sizeof(opt_float))
-				
-				if [problemSpec:UsesLambda()] and ((lIter + 1) % residual_reset_period) == 0 then
-                    gpu.PCGStep2_1stHalf(pd)
-                    gpu.computeAdelta(pd)
-                    if isGraph then
-                        gpu.computeAdelta_Graph(pd)
+            escape if problemSpec:UsesLambda() then
+                emit quote
+                    if pd.solverparameters.use_geodesic_acceleration ~= 0 then
+                        geodesicAcceleration(pd)
                     end
-                    gpu.PCGStep2_2ndHalf(pd)
-                else
-                    gpu.PCGStep2(pd)
                 end
-                logDebugCudaOptFloat("scanBetaNumerator", pd.scanBetaNumerator)
-                gpu.PCGStep3(pd)
-
-				-- save new rDotz for next iteration
-				C.cudaMemcpy(pd.scanAlphaNumerator, pd.scanBetaNumerator, sizeof(opt_float), C.cudaMemcpyDeviceToDevice)	
-				
-				if [problemSpec:UsesLambda()] then
-	                Q1 = fetchQ(pd)
-	                var zeta = [opt_float](lIter+1)*(Q1 - Q0) / Q1 
-                    --logSolver("%d: Q0(%g) Q1(%g), zeta(%g)\n", lIter, Q0, Q1, zeta)
-	                if zeta < q_tolerance then
-                        logSolver("zeta=%.18g, breaking at iteration: %d\n", zeta, (lIter+1))
-	                    break
-	                end
-	                Q0 = Q1
-				end
-			end
-			
+            end end
+            stats.linearResidual = fetchLinearResidual(pd)
+            var linearEnd = util.clock.opt_clock_ms()
+            stats.linearMs = linearEnd - iterationStart
 
             var model_cost_change : opt_float
 
             escape if problemSpec:UsesLambda() then
                 emit quote 
                     model_cost_change = computeModelCostChange(pd)
+                    stats.modelCost = pd.prevCost - model_cost_change
                     gpu.savePreviousUnknowns(pd)
                 end
+            else
+                emit quote
+                    if pd.solverparameters.anderson_depth > 0 then
+                        gpu.savePreviousUnknowns(pd)
+                    end
+                end
             end end
 
 			gpu.PCGLinearUpdate(pd)    
 			gpu.precompute(pd)
-			var newCost = computeCost(pd)
+			var newCost = computeCostAndJTF(pd)
+			stats.evaluateMs = util.clock.opt_clock_ms() - linearEnd
 
 			escape 
                 if problemSpec:UsesLambda() then
@@ -1128,6 +2382,8 @@ return function(problemSpec)
                             var absolute_function_tolerance = pd.prevCost * function_tolerance
                             if cost_change <= absolute_function_tolerance then
                                 logSolver("\nFunction tolerance reached, exiting\n")
+                                pd.prevCost = newCost -- the step is kept, so it is recorded with its cost
+                                recordIteration(pd, params_, &stats, iterationStart)
                                 cleanup(pd)
                                 return 0
                             end
@@ -1138,16 +2394,32 @@ return function(problemSpec)
                             pd.parameters.trust_region_radius = pd.parameters.trust_region_radius / util.cpuMath.fmax(min_factor, tmp_factor)
                             pd.parameters.trust_region_radius = util.cpuMath.fmin(pd.parameters.trust_region_radius, max_trust_region_radius)
                             pd.parameters.radius_decrease_factor = 2.0
+                            if [problemSpec.exacthessian] then
+                                if step_quality > 0.75 and pd.steihaugHitBoundary then
+                                    pd.steihaugRadius = util.cpuMath.fmin(2.0*pd.steihaugRadius, max_trust_region_radius)
+                                elseif step_quality < 0.25 then
+                                    pd.steihaugRadius = 0.25*pd.steihaugRadius
+                                end
+                            end
 
                             pd.prevCost = newCost
+                            if pd.solverparameters.anderson_depth > 0 then
+                                andersonAccelerate(pd)
+                            end
                         else 
+                            stats.accepted = 0
                             gpu.revertUpdate(pd)
+                            pd.jtfValid = false
 
                             pd.parameters.trust_region_radius = pd.parameters.trust_region_radius / pd.parameters.radius_decrease_factor
                             logSolver(" trust_region_radius=%f \n", pd.parameters.trust_region_radius)
                             pd.parameters.radius_decrease_factor = 2.0 * pd.parameters.radius_decrease_factor
+                            if [problemSpec.exacthessian] then
+                                pd.steihaugRadius = 0.25*pd.steihaugRadius
+                            end
                             if pd.parameters.trust_region_radius <= min_trust_region_radius then
                                 logSolver("\nTrust_region_radius is less than the min, exiting\n")
+                                recordIteration(pd, params_, &stats, iterationStart)
                                 cleanup(pd)
                                 return 0
                             end
@@ -1159,6 +2431,9 @@ return function(problemSpec)
                     emit quote
                         logSolver("cost: %f -> %f\n", pd.prevCost, newCost)
                         pd.prevCost = newCost 
+                        if pd.solverparameters.anderson_depth > 0 then
+                            andersonAccelerate(pd)
+                        end
                     end
                 end 
             end
@@ -1168,7 +2443,13 @@ return function(problemSpec)
             iteration_summary_.gradient_max_norm <= options_.gradient_tolerance
             ]]
 
+            var stop = recordIteration(pd, params_, &stats, iterationStart)
             pd.solverparameters.nIter = pd.solverparameters.nIter + 1
+            if stop then
+                logSolver("\nStopped by the iteration callback\n")
+                cleanup(pd)
+                return 0
+            end
             return 1
         else
             cleanup(pd)
@@ -1176,8 +2457,90 @@ return function(problemSpec)
         end
     end
 
+    -- predicted milliseconds for an outer iteration with n linear iterations, 0 before any iteration was timed
+    local terra predictStepMs(pd : &PlanData, n : int) : double
+        var fit = &pd.budgetFit[0]
+        if fit[0] == 0 then return 0.0 end
+        var meanN,meanT = fit[1]/fit[0],fit[2]/fit[0]
+        var varN = fit[3]/fit[0] - meanN*meanN
+        -- with the same iteration count every step, count the fixed cost as one more linear iteration
+        var b = meanT/(meanN + 1.0)
+        var a = b
+        if varN > 1e-6 then
+            var slope = (fit[4]/fit[0] - meanN*meanT)/varN
+            if slope > 0 and meanT - slope*meanN >= 0 then
+                a,b = meanT - slope*meanN,slope
+            end
+        end
+        return a + b*n
+    end
+
+    -- iterate under time_budget_ms: steps shrink their linear iterations to what the model says still fits,
+    -- the solve ends when not even one fits, and the best unknowns seen are restored at the end
+    local terra budgetedStep(data_ : &opaque, params_ : &&opaque)
+        var pd = [&PlanData](data_)
+        var budget = pd.solverparameters.time_budget_ms
+        pd.linearIterations = pd.solverparameters.lIterations
+        if not pd.budgetActive then -- the budget is read at init, like the other solver parameters
+            return iterate(data_, params_)
+        end
+        var start = util.clock.opt_clock_ms()
+        var remaining = budget - (start - pd.solveStartMs)
+        while pd.linearIterations > 0 and predictStepMs(pd, pd.linearIterations) > remaining do
+            pd.linearIterations = pd.linearIterations - 1
+        end
+        var more = 0
+        if pd.linearIterations > 0 and remaining > 0 then
+            pd.linearIterationsRun = 0
+            more = iterate(data_, params_)
+            var n,t = double(pd.linearIterationsRun),util.clock.opt_clock_ms() - start
+            var fit = &pd.budgetFit[0]
+            fit[0],fit[1],fit[2],fit[3],fit[4] = fit[0] + 1,fit[1] + n,fit[2] + t,fit[3] + n*n,fit[4] + n*t
+            if pd.prevCost < pd.bestCost then
+                gpu.saveBestUnknowns(pd)
+                pd.bestCost = pd.prevCost
+            end
+        else
+            logSolver("time budget of %f ms reached after %d iterations\n", budget, pd.solverparameters.nIter)
+            cleanup(pd)
+        end
+        if more == 0 and pd.bestCost < pd.prevCost then
+            gpu.restoreBestUnknowns(pd)
+            gpu.precompute(pd)
+            pd.prevCost = pd.bestCost
+            pd.jtfValid = false
+        end
+        return more
+    end
+
+    local terra step(data_ : &opaque, params_ : &&opaque)
+        if params_ == nil then
+            params_ = &[&PlanData](data_).bound[0]
+        end
+        var more = budgetedStep(data_, params_)
+        escape if _opt_shared_scratch then emit quote
+            if more == 0 then
+                releaseScratch([&PlanData](data_))
+            end
+        end end end
+        return more
+    end
+
+    -- ends a solve that was stopped between steps, as step does when it returns 0
+    local terra finish(data_ : &opaque)
+        var pd = [&PlanData](data_)
+        cleanup(pd)
+        escape if _opt_shared_scratch then emit quote releaseScratch(pd) end end end
+    end
+
+    -- the cost computed by the last init or step, re-evaluated only if parameters changed since.
+    -- Whatever changed them already read the new values into pd.parameters, so the caller's params
+    -- array is not touched after the solve returned
     local terra cost(data_ : &opaque) : double
         var pd = [&PlanData](data_)
+        if pd.costEpoch ~= pd.parameterEpoch then
+            refreshCost(pd)
+        end
         return [double](pd.prevCost)
     end
 
@@ -1220,22 +2583,134 @@ return function(problemSpec)
         logSolver("Warning: tried to set nonexistent solver parameter %s\n", name)
     end
 
+    -- specializations of one problem share the PlanData layout up to and including solverparameters
+    local terra copySolverParameters(dst_ : &opaque, src_ : &opaque)
+        [&PlanData](dst_).solverparameters = [&PlanData](src_).solverparameters
+    end
+
+    -- outer iterations left before the iteration limit, used by the worker pool to order solves
+    local terra remainingIterations(data_ : &opaque) : int
+        var pd = [&PlanData](data_)
+        var left = pd.solverparameters.nIterations - pd.solverparameters.nIter
+        if left < 0 then left = 0 end
+        return left
+    end
+
+    local terra bindParameters(data_ : &opaque, params_ : &&opaque)
+        var pd = [&PlanData](data_)
+        for i = 0,NPARAMS do
+            pd.bound[i] = params_[i]
+        end
+        if pd.paramsBound then
+            [util.initParameters(`pd.parameters,problemSpec,`&pd.bound[0],false)]
+        else
+            [util.initParameters(`pd.parameters,problemSpec,`&pd.bound[0],true)]
+            pd.paramsBound = true
+        end
+        pd.parameterEpoch = pd.parameterEpoch + 1
+    end
+    local terra boundParameters(data_ : &opaque) : &&opaque
+        var pd = [&PlanData](data_)
+        if not pd.paramsBound then return nil end
+        return &pd.bound[0]
+    end
+
+    local terra statistics(data_ : &opaque, result : &&opt.IterationStatistics) : int
+        var pd = [&PlanData](data_)
+        @result = pd.statistics._data
+        return pd.statistics:size()
+    end
+
+    -- replace one entry of the bound array, addressed by the name it has in the energy specification
+    local terra updateParameter(data_ : &opaque, name : rawstring, ptr : &opaque) : int
+        var pd = [&PlanData](data_)
+        if not pd.paramsBound then
+            logSolver("Warning: tried to update parameter %s before Opt_PlanBindParameters\n", name)
+            return 0
+        end
+        escape
+            -- an if-statement chain, like setSolverParameter
+            local function update(pname,idx,register)
+                return quote
+                    if C.strcmp(pname,name) == 0 then
+                        pd.bound[idx] = ptr
+                        [register or quote end]
+                        [util.initParameters(`pd.parameters,problemSpec,`&pd.bound[0],false)]
+                        pd.parameterEpoch = pd.parameterEpoch + 1
+                        return 1
+                    end
+                end
+            end
+            for _,entry in ipairs(problemSpec.parameters) do
+                if entry.kind == "ImageParam" and entry.idx ~= "alloc" then
+                    local loc = entry.isunknown and (`pd.parameters.X.[entry.name]) or `pd.parameters.[entry.name]
+                    emit update(entry.name, entry.idx, quote loc:setGPUptr([&uint8](ptr)) end)
+                elseif entry.kind == "ScalarParam" and entry.idx >= 0 then
+                    emit update(entry.name, entry.idx)
+                elseif entry.kind == "GraphParam" then
+                    emit update(entry.name, entry.idx)
+                    for _,e in ipairs(entry.type.metamethods.elements) do
+                        emit update(e.name, e.idx)
+                    end
+                end
+            end
+        end
+        logSolver("Warning: tried to update nonexistent parameter %s\n", name)
+        return 0
+    end
+
     local terra free(data_ : &opaque)
         var pd = [&PlanData](data_)
-        pd.delta:freeData()
-        pd.r:freeData()
-        pd.b:freeData()
-        pd.Adelta:freeData()
-        pd.z:freeData()
-        pd.p:freeData()
-        pd.Ap_X:freeData()
-        pd.CtC:freeData()
-        pd.SSq:freeData()
-        pd.preconditioner:freeData()
-        pd.g:freeData()
-        pd.prevX:freeData()
+        escape
+            if _opt_shared_scratch then
+                emit quote releaseScratch(pd) end
+            else
+                for _,name in ipairs(scratchvectors) do
+                    emit quote pd.[name]:freeData() end
+                end
+            end
+        end
+        if pd.bestAllocated then
+            pd.bestX:freeData()
+            pd.bestAllocated = false
+        end
+        if pd.geodesicAllocated then
+            pd.velocity:freeData()
+            pd.geodesicDirection:freeData()
+            cd(C.cudaFree([&opaque](pd.geodesicNorms)))
+            pd.geodesicAllocated = false
+        end
+        if pd.andersonAllocatedDepth > 0 then
+            for i = 0,pd.andersonAllocatedDepth do
+                pd.andersonDX[i]:freeData()
+                pd.andersonDF[i]:freeData()
+            end
+            pd.andersonPrevX:freeData()
+            pd.andersonPrevF:freeData()
+            pd.andersonBackup:freeData()
+            cd(C.cudaFree([&opaque](pd.andersonDots)))
+            pd.andersonAllocatedDepth = 0
+        end
+        if pd.steihaugDots ~= nil then
+            cd(C.cudaFree([&opaque](pd.steihaugDots)))
+            pd.steihaugDots = nil
+        end
+        if pd.specReductions ~= nil then
+            for k = 0,K do
+                pd.specDelta[k]:freeData()
+                pd.specR[k]:freeData()
+                pd.specZ[k]:freeData()
+                pd.specP[k]:freeData()
+                pd.specAp[k]:freeData()
+                pd.specPre[k]:freeData()
+                pd.specCtC[k]:freeData()
+            end
+            cd(C.cudaFree([&opaque](pd.specReductions)))
+            pd.specReductions = nil
+        end
 
         [util.freePrecomputedImages(`pd.parameters,problemSpec)]
+        pd.statistics:__destruct()
 
         cd(C.cudaFree([&opaque](pd.scanAlphaNumerator)))
         cd(C.cudaFree([&opaque](pd.scanBetaNumerator)))
@@ -1255,18 +2730,22 @@ return function(problemSpec)
 		var pd = PlanData.alloc()
 		pd.plan.data = pd
 		pd.plan.init,pd.plan.step,pd.plan.cost,pd.plan.setsolverparameter,pd.plan.free = init,step,cost,setSolverParameter,free
-		pd.delta:initGPU()
-		pd.r:initGPU()
-        pd.b:initGPU()
-        pd.Adelta:initGPU()
-		pd.z:initGPU()
-		pd.p:initGPU()
-		pd.Ap_X:initGPU()
-        pd.CtC:initGPU()
-        pd.SSq:initGPU()
-		pd.preconditioner:initGPU()
-		pd.g:initGPU()
-        pd.prevX:initGPU()
+		pd.plan.copysolverparameters,pd.plan.remaining,pd.plan.finish = copySolverParameters,remainingIterations,finish
+		pd.plan.bind,pd.plan.boundparameters,pd.plan.updateparameter = bindParameters,boundParameters,updateParameter
+		pd.paramsBound = false
+		for i = 0,NPARAMS do pd.bound[i] = nil end
+		pd.prevCost,pd.costEpoch,pd.parameterEpoch = 0.0,0,0
+		pd.plan.statistics,pd.plan.callback,pd.plan.callbackdata = statistics,nil,nil
+		pd.statistics:init()
+		pd.plan.specialize,pd.plan.active = nil,&pd.plan
+		pd.scratchData = nil
+		escape
+		    if not _opt_shared_scratch then
+		        for _,name in ipairs(scratchvectors) do
+		            emit quote pd.[name]:initGPU() end
+		        end
+		    end
+		end
 
         initializeSolverParameters(&pd.solverparameters)
 		
@@ -1280,6 +2759,31 @@ return function(problemSpec)
         C.cudaMalloc([&&opaque](&(pd.q)), sizeof(opt_float))
 		pd.J_csrValA = nil
 		pd.JTJ_csrRowPtrA = nil
+		pd.geodesicAllocated = false
+		pd.geodesicNorms = nil
+		pd.andersonAllocatedDepth = 0
+		pd.andersonDots = nil
+		pd.steihaugDots = nil
+		if [problemSpec.exacthessian] then
+			C.cudaMalloc([&&opaque](&(pd.steihaugDots)), 3*sizeof(opt_float))
+		end
+		pd.jtfValid = false
+		pd.graphBlockOffset = 0
+		pd.budgetActive,pd.bestAllocated = false,false
+		pd.linearIterations = 0
+		pd.specReductions = nil
+		if [K > 0] then
+			for k = 0,K do
+				pd.specDelta[k]:initGPU()
+				pd.specR[k]:initGPU()
+				pd.specZ[k]:initGPU()
+				pd.specP[k]:initGPU()
+				pd.specAp[k]:initGPU()
+				pd.specPre[k]:initGPU()
+				pd.specCtC[k]:initGPU()
+			end
+			C.cudaMalloc([&&opaque](&(pd.specReductions)), SPEC_SLOTS*K*sizeof(opt_float))
+		end
 		return &pd.plan
 	end
 
@@ -326,6 +326,9 @@ function Array(T,debug)
         end
     end
     terra Array:size() return self._size end
+    terra Array:clear() -- keeps the allocation
+        self._size = 0
+    end
     
     terra Array:get(i : int32)
         assert(i < self._size) 
@@ -385,6 +388,7 @@ function Array(T,debug)
 end
 
 local Array = S.memoize(Array)
+util.Array = Array
 
 local warpSize = 32
 util.warpSize = warpSize
@@ -411,6 +415,27 @@ local TimingInfo = util.TimingInfo
 
 util.TimerEvent = C.cudaEvent_t
 
+-- monotonic host wall clock in milliseconds
+util.clock = terralib.includecstring [[
+#ifdef _WIN32
+	#define WIN32_LEAN_AND_MEAN
+	#include <windows.h>
+	double opt_clock_ms() {
+		LARGE_INTEGER count, frequency;
+		QueryPerformanceCounter(&count);
+		QueryPerformanceFrequency(&frequency);
+		return 1000.0 * (double)count.QuadPart / (double)frequency.QuadPart;
+	}
+#else
+	#include <time.h>
+	double opt_clock_ms() {
+		struct timespec t;
+		clock_gettime(CLOCK_MONOTONIC, &t);
+		return 1000.0 * (double)t.tv_sec + 1e-6 * (double)t.tv_nsec;
+	}
+#endif
+]]
+
 struct util.Timer {
 	timingInfo : &Array(TimingInfo)
 }
@@ -745,10 +770,11 @@ util.getValidUnknown = macro(function(pd,pw,ph)
 		 @pw < pd.parameters.X:W() and @ph < pd.parameters.X:H() 
 	end
 end)
+-- pd.graphBlockOffset is the number of leading blocks that run the centered half of a fused launch, see makeFusedLauncher
 util.getValidGraphElement = macro(function(pd,graphname,idx)
 	graphname = graphname:asvalue()
 	return quote
-		@idx = blockDim.x * blockIdx.x + threadIdx.x
+		@idx = blockDim.x * (blockIdx.x - pd.graphBlockOffset) + threadIdx.x
 	in
 		 @idx < pd.parameters.[graphname].N 
 	end
@@ -862,8 +888,53 @@ local function makeGPULauncher(PlanData,kernelName,ft,compiledKernel)
     return GPULauncher
 end
 
-function util.makeGPUFunctions(problemSpec, PlanData, delegate, names)
-    -- step 1: compile the actual cuda kernels
+-- A fusion {name, centered, graph} launches the centered and graph kernels of one phase as a single
+-- kernel: the first blocks run the centered kernel, the rest the graph kernel. Only phases whose two
+-- kernels just accumulate into separate reductions can be fused, since the blocks run in no particular order.
+-- Needs exactly one 1-D centered function and one graph function, so both halves use the same block shape
+local function findfusion(problemSpec,kernelFunctions,getkname,fusion)
+    local centered,graph
+    for _,problemfunction in ipairs(problemSpec.functions) do
+        local typ = problemfunction.typ
+        if typ.kind == "CenteredFunction" and kernelFunctions[getkname(fusion.centered,typ)] then
+            if centered or #typ.ispace.dims ~= 1 then return nil end
+            centered = problemfunction
+        elseif typ.kind == "GraphFunction" and kernelFunctions[getkname(fusion.graph,typ)] then
+            if graph then return nil end
+            graph = problemfunction
+        end
+    end
+    return centered and graph and { centered = centered, graph = graph }
+end
+
+local function makeFusedLauncher(PlanData,kernelName,fused,compiledKernel)
+    local centeredsize = fused.centered.typ.ispace.dims[1].size
+    local graphname = fused.graph.typ.graphname
+    local blocksize = BLOCK_DIMS[1][1]
+    local terra GPULauncher(pd : &PlanData)
+        var centeredblocks = (centeredsize - 1) / blocksize + 1
+        var graphblocks = (pd.parameters.[graphname].N - 1) / blocksize + 1
+        var launch = terralib.CUDAParams { centeredblocks + graphblocks, 1, 1, blocksize, 1, 1, 0, nil }
+        var endEvent : C.cudaEvent_t 
+        if ([_opt_collect_kernel_timing]) then
+            pd.timer:startEvent(kernelName,nil,&endEvent)
+        end
+
+        pd.graphBlockOffset = centeredblocks
+        checkedLaunch(kernelName, compiledKernel(&launch, @pd))
+        pd.graphBlockOffset = 0
+        
+        if ([_opt_collect_kernel_timing]) then
+            pd.timer:endEvent(nil,endEvent)
+        end
+
+        cd(C.cudaGetLastError())
+    end
+    return GPULauncher
+end
+
+function util.makeGPUFunctions(problemSpec, PlanData, delegate, names, fusions)
+    -- step 1: define the cuda kernels, compiled on demand in step 2
     local kernelFunctions = {}
     local key = tostring(os.time())
     local function getkname(name,ft)
@@ -887,43 +958,335 @@ function util.makeGPUFunctions(problemSpec, PlanData, delegate, names)
             end
         end
     end
-    if verbosePTX then
-        print("Compiling kernels!")
+    -- step 2: kernels are compiled the first time solver code that launches them is compiled, so
+    -- kernels behind disabled paths (e.g. saveJToCRS without cuSPARSE, LM-only ones under Gauss-Newton)
+    -- are never compiled. Each named group is one cudacompile batch
+    local function compilekernels(knames)
+        local batch = {}
+        for _,kname in ipairs(knames) do
+            batch[kname] = kernelFunctions[kname]
+        end
+        if verbosePTX then
+            print("Compiling kernels: "..table.concat(knames,", "))
+        end
+        return terralib.cudacompile(batch, verbosePTX)
+    end
+    local function lazylauncher(build)
+        local fn
+        return macro(function(...)
+            fn = fn or build()
+            local args = {...}
+            return `fn([args])
+        end)
     end
-    local kernels = terralib.cudacompile(kernelFunctions, verbosePTX)
     
-    -- step 2: generate wrapper functions around each named thing
-    local grouplaunchers = {}
-    for _,name in ipairs(names) do
-        local args
-        local launches = terralib.newlist()
+    local function makegrouplauncher(name)
+        local knames,fts = terralib.newlist(),terralib.newlist()
         for _,problemfunction in ipairs(problemSpec.functions) do
             local kname = getkname(name,problemfunction.typ)
-            local kernel = kernels[kname]
-            if kernel then -- some domains do not have an associated kernel, (see _Finish kernels in GN which are only defined for 
-                local launcher = makeGPULauncher(PlanData, name, problemfunction.typ, kernel)
-                if not args then
-                    args = launcher:gettype().parameters:map(symbol)
-                end
-                launches:insert(`launcher(args))
+            if kernelFunctions[kname] then -- some domains do not have an associated kernel, (see _Finish kernels in GN which are only defined for 
+                knames:insert(kname)
+                fts:insert(problemfunction.typ)
             else
                 --print("not found: "..name.." for "..tostring(problemfunction.typ))
             end
         end
-        local fn
-        if not args then
-            fn = macro(function() return `{} end) -- dummy function for blank groups occur for things like precompute and _Graph when they are not present
-        else
-            fn = terra([args]) launches end
-            fn:setname(name)
-            fn:gettype()
+        if #knames == 0 then
+            return macro(function() return `{} end) -- dummy function for blank groups occur for things like precompute and _Graph when they are not present
         end
-        grouplaunchers[name] = fn 
+        local kernels = compilekernels(knames)
+        local args
+        local launches = terralib.newlist()
+        for i,kname in ipairs(knames) do
+            local launcher = makeGPULauncher(PlanData, name, fts[i], kernels[kname])
+            if not args then
+                args = launcher:gettype().parameters:map(symbol)
+            end
+            launches:insert(`launcher(args))
+        end
+        local fn = terra([args]) launches end
+        fn:setname(name)
+        fn:gettype()
+        return fn
+    end
+    
+    local grouplaunchers = {}
+    for _,name in ipairs(names) do
+        grouplaunchers[name] = lazylauncher(function() return makegrouplauncher(name) end)
+    end
+    for _,fusion in ipairs(fusions or {}) do
+        grouplaunchers[fusion.name] = lazylauncher(function()
+            local fused = findfusion(problemSpec,kernelFunctions,getkname,fusion)
+            if not fused then -- separate launches, centered first
+                local centered,graph = grouplaunchers[fusion.centered],grouplaunchers[fusion.graph]
+                return macro(function(pd) return quote centered(pd) graph(pd) end end)
+            end
+            -- fresh copies of the two kernels, an entry point cannot be called from another kernel
+            local centeredkernel = delegate.CenterFunctions(fused.centered.typ.ispace,fused.centered.functionmap)[fusion.centered]
+            local graphkernel = delegate.GraphFunctions(fused.graph.typ.graphname,fused.graph.functionmap)[fusion.graph]
+            local terra fusedkernel(pd : PlanData)
+                if blockIdx.x < pd.graphBlockOffset then
+                    centeredkernel(pd)
+                else
+                    graphkernel(pd)
+                end
+            end
+            local kname = string.format("%s_fused_%s",fusion.name,key)
+            kernelFunctions[kname] = { kernel = fusedkernel, annotations = { {"maxntidx", BLOCK_DIMS[1][1]}, {"minctasm",1} } }
+            return makeFusedLauncher(PlanData,fusion.name,fused,compilekernels({kname})[kname])
+        end)
     end
     return grouplaunchers
 end
 
 
+-- portable threads for the worker pool that runs asynchronous solves
+util.threads = terralib.includecstring [[
+#include <stdlib.h>
+typedef void (*opt_thread_fn)(void*);
+typedef struct { opt_thread_fn fn; void* arg; } opt_thread_start;
+#ifdef _WIN32
+	#define WIN32_LEAN_AND_MEAN
+	#include <windows.h>
+	typedef CRITICAL_SECTION opt_mutex;
+	typedef CONDITION_VARIABLE opt_cond;
+	typedef HANDLE opt_thread;
+	DWORD WINAPI opt_thread_trampoline(LPVOID p) {
+		opt_thread_start s = *(opt_thread_start*)p;
+		free(p);
+		s.fn(s.arg);
+		return 0;
+	}
+	int opt_thread_create(opt_thread* t, opt_thread_fn fn, void* arg) {
+		opt_thread_start* s = (opt_thread_start*)malloc(sizeof(opt_thread_start));
+		s->fn = fn; s->arg = arg;
+		*t = CreateThread(NULL, 0, opt_thread_trampoline, s, 0, NULL);
+		return *t == NULL;
+	}
+	void opt_thread_join(opt_thread t) { WaitForSingleObject(t, INFINITE); CloseHandle(t); }
+	void opt_mutex_init(opt_mutex* m) { InitializeCriticalSection(m); }
+	void opt_mutex_lock(opt_mutex* m) { EnterCriticalSection(m); }
+	int opt_mutex_trylock(opt_mutex* m) { return TryEnterCriticalSection(m) != 0; }
+	void opt_mutex_unlock(opt_mutex* m) { LeaveCriticalSection(m); }
+	void opt_mutex_destroy(opt_mutex* m) { DeleteCriticalSection(m); }
+	void opt_cond_init(opt_cond* c) { InitializeConditionVariable(c); }
+	void opt_cond_destroy(opt_cond* c) { }
+	void opt_cond_wait(opt_cond* c, opt_mutex* m) { SleepConditionVariableCS(c, m, INFINITE); }
+	void opt_cond_signal(opt_cond* c) { WakeConditionVariable(c); }
+	void opt_cond_broadcast(opt_cond* c) { WakeAllConditionVariable(c); }
+	int opt_cpu_count() { SYSTEM_INFO si; GetSystemInfo(&si); return (int)si.dwNumberOfProcessors; }
+#else
+	#include <pthread.h>
+	#include <unistd.h>
+	typedef pthread_mutex_t opt_mutex;
+	typedef pthread_cond_t opt_cond;
+	typedef pthread_t opt_thread;
+	void* opt_thread_trampoline(void* p) {
+		opt_thread_start s = *(opt_thread_start*)p;
+		free(p);
+		s.fn(s.arg);
+		return NULL;
+	}
+	int opt_thread_create(opt_thread* t, opt_thread_fn fn, void* arg) {
+		opt_thread_start* s = (opt_thread_start*)malloc(sizeof(opt_thread_start));
+		s->fn = fn; s->arg = arg;
+		return pthread_create(t, NULL, opt_thread_trampoline, s);
+	}
+	void opt_thread_join(opt_thread t) { pthread_join(t, NULL); }
+	void opt_mutex_init(opt_mutex* m) { pthread_mutex_init(m, NULL); }
+	void opt_mutex_lock(opt_mutex* m) { pthread_mutex_lock(m); }
+	int opt_mutex_trylock(opt_mutex* m) { return pthread_mutex_trylock(m) == 0; }
+	void opt_mutex_unlock(opt_mutex* m) { pthread_mutex_unlock(m); }
+	void opt_mutex_destroy(opt_mutex* m) { pthread_mutex_destroy(m); }
+	void opt_cond_init(opt_cond* c) { pthread_cond_init(c, NULL); }
+	void opt_cond_destroy(opt_cond* c) { pthread_cond_destroy(c); }
+	void opt_cond_wait(opt_cond* c, opt_mutex* m) { pthread_cond_wait(c, m); }
+	void opt_cond_signal(opt_cond* c) { pthread_cond_signal(c); }
+	void opt_cond_broadcast(opt_cond* c) { pthread_cond_broadcast(c); }
+	int opt_cpu_count() { return (int)sysconf(_SC_NPROCESSORS_ONLN); }
+#endif
+]]
+local T = util.threads
+
+struct util.Job {
+    run : {&opaque} -> {}
+    arg : &opaque
+    priority : int -- higher runs first
+    rank : int -- among equal priorities lower runs first, e.g. the work a job has left
+    next : &util.Job
+}
+local Job = util.Job
+
+-- a fixed set of threads shared by all jobs of a state, started on first use. Jobs are short
+-- (one solver iteration) and requeue themselves, so each time a thread frees up the queue is
+-- rebalanced: the highest priority job runs next, the one with the least work left among equals
+struct util.WorkerPool {
+    lock : T.opt_mutex
+    wake : T.opt_cond
+    head : &Job
+    threads : &T.opt_thread
+    nthreads : int
+    stopping : bool -- set by shutdown, threads exit once the queue is empty
+}
+local WorkerPool = util.WorkerPool
+
+terra WorkerPool:work()
+    while true do
+        T.opt_mutex_lock(&self.lock)
+        while self.head == nil and not self.stopping do
+            T.opt_cond_wait(&self.wake,&self.lock)
+        end
+        if self.head == nil then
+            T.opt_mutex_unlock(&self.lock)
+            return
+        end
+        var best : &&Job = &self.head
+        var link : &&Job = &self.head.next
+        while @link ~= nil do
+            var j,b = @link,@best
+            if j.priority > b.priority or (j.priority == b.priority and j.rank < b.rank) then
+                best = link
+            end
+            link = &j.next
+        end
+        var job = @best
+        @best = job.next
+        T.opt_mutex_unlock(&self.lock)
+        job.run(job.arg)
+        C.free(job)
+    end
+end
+local terra workerMain(pool : &opaque)
+    [&WorkerPool](pool):work()
+end
+
+terra WorkerPool:init(nthreads : int)
+    T.opt_mutex_init(&self.lock)
+    T.opt_cond_init(&self.wake)
+    self.head = nil
+    self.stopping = false
+    self.threads = [&T.opt_thread](C.malloc(nthreads*sizeof(T.opt_thread)))
+    self.nthreads = 0
+    for i = 0,nthreads do
+        if T.opt_thread_create(&self.threads[self.nthreads],workerMain,self) == 0 then
+            self.nthreads = self.nthreads + 1
+        end
+    end
+end
+
+-- runs the jobs still queued, including the ones they requeue, then joins the threads.
+-- Must not be called from a job, which would wait for its own thread
+terra WorkerPool:shutdown()
+    T.opt_mutex_lock(&self.lock)
+    self.stopping = true
+    T.opt_cond_broadcast(&self.wake)
+    T.opt_mutex_unlock(&self.lock)
+    for i = 0,self.nthreads do
+        T.opt_thread_join(self.threads[i])
+    end
+    C.free(self.threads)
+    self.nthreads = 0
+    T.opt_cond_destroy(&self.wake)
+    T.opt_mutex_destroy(&self.lock)
+end
+
+-- queued at the back, so equal jobs run in FIFO order
+terra WorkerPool:submit(run : {&opaque} -> {}, arg : &opaque, priority : int, rank : int)
+    var job = [&Job](C.malloc(sizeof(Job)))
+    job.run,job.arg,job.priority,job.rank,job.next = run,arg,priority,rank,nil
+    T.opt_mutex_lock(&self.lock)
+    var link : &&Job = &self.head
+    while @link ~= nil do
+        link = &(@link).next
+    end
+    @link = job
+    T.opt_cond_signal(&self.wake)
+    T.opt_mutex_unlock(&self.lock)
+end
+
+-- device memory lent to the plans of a state for the duration of a solve (sharedSolverScratch). Released
+-- blocks are kept per size class and handed to the next request of that class, so idle plans hold nothing
+-- and the arena only grows to what the plans solving at the same time need
+local SCRATCH_MIN_BYTES = 64*1024
+local SCRATCH_CLASSES = 4*32 -- classes step by a quarter power of two, so a block is at most 25% larger than asked
+struct util.ScratchBlock {
+    data : &uint8
+    next : &util.ScratchBlock
+}
+local ScratchBlock = util.ScratchBlock
+struct util.ScratchArena {
+    lock : T.opt_mutex
+    cached : (&ScratchBlock)[SCRATCH_CLASSES]
+}
+local ScratchArena = util.ScratchArena
+
+local terra scratchClassBytes(c : int) : int64
+    return ([int64](SCRATCH_MIN_BYTES)/4*(4 + c%4)) << (c/4)
+end
+local terra scratchClass(bytes : int64) : int
+    var c = 0
+    while scratchClassBytes(c) < bytes do
+        c = c + 1
+    end
+    return c
+end
+
+terra ScratchArena:init()
+    T.opt_mutex_init(&self.lock)
+    for c = 0,SCRATCH_CLASSES do
+        self.cached[c] = nil
+    end
+end
+
+-- free every cached block, the lock must be held
+terra ScratchArena:freeCached()
+    for c = 0,SCRATCH_CLASSES do
+        while self.cached[c] ~= nil do
+            var block = self.cached[c]
+            self.cached[c] = block.next
+            cd(C.cudaFree(block.data))
+            C.free(block)
+        end
+    end
+end
+
+-- at least 'bytes' of device memory, return it with release(data,bytes)
+terra ScratchArena:acquire(bytes : int64) : &uint8
+    var c = scratchClass(bytes)
+    var data : &uint8 = nil
+    T.opt_mutex_lock(&self.lock)
+    var block = self.cached[c]
+    if block ~= nil then
+        self.cached[c] = block.next
+        data = block.data
+        C.free(block)
+    elseif C.cudaMalloc([&&opaque](&data), scratchClassBytes(c)) ~= 0 then
+        -- out of memory: give the blocks cached for other sizes back to the device and try once more
+        C.cudaGetLastError()
+        self:freeCached()
+        cd(C.cudaMalloc([&&opaque](&data), scratchClassBytes(c)))
+    end
+    T.opt_mutex_unlock(&self.lock)
+    return data
+end
+
+terra ScratchArena:release(data : &uint8, bytes : int64)
+    var c = scratchClass(bytes)
+    var block = [&ScratchBlock](C.malloc(sizeof(ScratchBlock)))
+    block.data = data
+    T.opt_mutex_lock(&self.lock)
+    block.next = self.cached[c]
+    self.cached[c] = block
+    T.opt_mutex_unlock(&self.lock)
+end
+
+util.scratcharena = global(ScratchArena)
+if _opt_shared_scratch then
+    local terra initScratchArena() util.scratcharena:init() end
+    initScratchArena()
+end
+
+
 function util.reportGPUMemoryUse()
     local terra reportMem()
         var free_byte : C.size_t
@@ -1,6 +1,9 @@
 local DEPTH_DISCONTINUITY_THRE = 0.01
 local W,H 	= Dim("W",0), Dim("H",1)
 
+-- the weights and camera intrinsics stay fixed across frames, the lighting does not
+Specialize("w_p","w_s","w_g","f_x","f_y","u_x","u_y")
+
 local w_p	    = sqrt(Param("w_p",float,0))-- Fitting weight
 local w_s	    = sqrt(Param("w_s",float,1))-- Regularization weight
 local w_g	    = sqrt(Param("w_g",float,2))-- Shading weight
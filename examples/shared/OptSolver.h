@@ -76,10 +76,16 @@ public:
             finalProblemParameters = copyParametersAndConvertUnknownsToDouble(problemParameters);
         }
         setAllSolverParameters(m_optimizerState, m_plan, solverParameters);
+        // rebind only when a buffer changed, repeated solves on the same buffers reuse the bound parameters
+        std::vector<void*> data = finalProblemParameters.data();
+        if (data != m_boundParameters) {
+            Opt_PlanBindParameters(m_optimizerState, m_plan, data.data());
+            m_boundParameters = data;
+        }
         if (profiledSolve) {
-            launchProfiledSolve(m_optimizerState, m_plan, finalProblemParameters.data().data(), iters);
+            launchProfiledSolve(m_optimizerState, m_plan, nullptr, iters);
         } else {
-            Opt_ProblemSolve(m_optimizerState, m_plan, finalProblemParameters.data().data());
+            Opt_ProblemSolve(m_optimizerState, m_plan, nullptr);
         }
         m_finalCost = Opt_ProblemCurrentCost(m_optimizerState, m_plan);
 
@@ -93,5 +99,6 @@ public:
 	Opt_State*		m_optimizerState;
 	Opt_Problem*	m_problem;
 	Opt_Plan*		m_plan;
+    std::vector<void*> m_boundParameters;
     bool m_doublePrecision = false;
 };
\ No newline at end of file
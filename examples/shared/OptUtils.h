@@ -34,11 +34,21 @@ protected:
     LARGE_INTEGER lastTick;
 };
 #else
+#include <chrono>
 class SimpleTimer {
 public:
-    void init() {}
+    void init() {
+        lastTick = std::chrono::steady_clock::now();
+    }
     // Time since last tick in ms
-    double tick() { return nanf("");}
+    double tick() {
+        auto currentTick = std::chrono::steady_clock::now();
+        double elapsedTime = std::chrono::duration<double, std::milli>(currentTick - lastTick).count();
+        lastTick = currentTick;
+        return elapsedTime;
+    }
+protected:
+    std::chrono::steady_clock::time_point lastTick;
 };
 #endif
 
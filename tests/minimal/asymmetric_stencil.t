@@ -0,0 +1,9 @@
+W,H = Dim("W",0), Dim("H",1)
+X = Unknown("X",float,{W,H},0)
+A = Array("A",float,{W,H},1)
+w_fit = .2
+-- the regularization is not symmetric in its offsets, so the derivatives of a residual's shifted
+-- instances differ per unknown and a mixed up shift changes the solution
+Energy(w_fit*(X(0,0) - A(0,0)), --fitting
+X(1,0) - 0.5*X(0,0), --regularization
+X(0,1) - 0.5*X(1,1))
\ No newline at end of file
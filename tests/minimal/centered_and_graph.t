@@ -0,0 +1,8 @@
+N = Dim("N",0)
+X = Unknown("X",float,{N},0)
+A = Array("A",float,{N},1)
+local G = Graph("G", 2, "i", {N}, 3, "j", {N}, 4)
+w_fit = .2
+-- one 1-D centered energy and one graph energy, whose cost reductions run as one launch
+Energy(w_fit*(X(0) - A(0))) --fitting
+Energy(X(G.i) - X(G.j)) --smoothness along the edges
\ No newline at end of file
@@ -0,0 +1,8 @@
+W,H = Dim("W",0), Dim("H",1)
+X = Unknown("X",float,{W,H},0)
+A = Array("A",float,{W,H},1)
+UseExactHessian(true)
+-- the fitting residual is nonlinear in X, so its second-order term is not zero
+Energy(X(0,0)*X(0,0) - A(0,0), --fitting
+(X(0,0) - X(1,0)), --regularization
+(X(0,0) - X(0,1)))
\ No newline at end of file
@@ -0,0 +1,9 @@
+W,H = Dim("W",0), Dim("H",1)
+X = Unknown("X",float,{W,H},0)
+A = Array("A",float,{W,H},1)
+-- every residual reads S at (0,0), so each pixel's gain is a local unknown
+S = Unknown("S",float,{W,H},2)
+Energy(S(0,0)*X(0,0) - A(0,0), --fitting with a per-pixel gain
+(X(0,0) - X(1,0)), --regularization
+(X(0,0) - X(0,1)),
+0.1*(S(0,0) - 1)) --keeps the gain near 1
\ No newline at end of file
@@ -2,18 +2,124 @@
 #include "Opt.h"
 }
 #include <cstdlib>
+#include <cmath>
+#include <algorithm>
+#include <fstream>
 #include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
 #include <cuda_runtime.h>
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "../shared/stb_image_write.h"
 
-void solveLaplacian(int width, int height, float* unknown, float* target) {
+static int failures = 0;
+static void check(bool condition, const char* what) {
+    if (!condition) {
+        std::cerr << "FAILED: " << what << std::endl;
+        ++failures;
+    }
+}
+
+static Opt_State* newState(int sharedSolverScratch = 0) {
     Opt_InitializationParameters param = {};
     param.doublePrecision = 0;
     param.verbosityLevel = 1;
     param.collectPerKernelTimingInfo = 1;
+    param.sharedSolverScratch = sharedSolverScratch;
     //param.threadsPerBlock = 512;
-    Opt_State* state = Opt_NewState(param);
+    return Opt_NewState(param);
+}
+
+// a plan of the W x H problem in 'filename' in a state of its own
+struct TestPlan {
+    Opt_State* state;
+    Opt_Problem* problem;
+    Opt_Plan* plan;
+};
+
+static TestPlan newPlan(const char* filename, const char* solverkind, int width, int height, int sharedSolverScratch = 0) {
+    TestPlan p;
+    p.state = newState(sharedSolverScratch);
+    p.problem = Opt_ProblemDefine(p.state, filename, solverkind);
+    unsigned int dims[] = { (unsigned int)width, (unsigned int)height };
+    p.plan = Opt_ProblemPlan(p.state, p.problem, dims);
+    return p;
+}
+
+static void freePlan(TestPlan& p) {
+    Opt_PlanFree(p.state, p.plan);
+    Opt_ProblemDelete(p.state, p.problem);
+}
+
+static void setIntParameter(TestPlan& p, const char* name, int value) {
+    Opt_SetSolverParameter(p.state, p.plan, name, &value);
+}
+
+static std::vector<Opt_IterationStatistics> getStatistics(TestPlan& p) {
+    std::vector<Opt_IterationStatistics> statistics(Opt_PlanGetStatistics(p.state, p.plan, NULL, 0));
+    if (!statistics.empty()) {
+        Opt_PlanGetStatistics(p.state, p.plan, &statistics[0], (int)statistics.size());
+    }
+    return statistics;
+}
+
+// solves with the laplacian's parameters { unknown, target } and an optional third parameter 'extra',
+// starting from unknown = target. Returns the statistics of every outer iteration, and the cost before
+// the first one in 'initialCost'
+static std::vector<Opt_IterationStatistics> solveFromTarget(TestPlan& p, int width, int height, float* unknown, float* target,
+                                                            double* initialCost = NULL, void* extra = NULL) {
+    cudaMemcpy(unknown, target, width*height*sizeof(float), cudaMemcpyDeviceToDevice);
+    void* problem_data[] = { unknown, target, extra };
+    Opt_ProblemInit(p.state, p.plan, problem_data);
+    if (initialCost) {
+        *initialCost = Opt_ProblemCurrentCost(p.state, p.plan);
+    }
+    while (Opt_ProblemStep(p.state, p.plan, problem_data)) {}
+    return getStatistics(p);
+}
+
+static std::vector<float> download(const float* d_data, int count) {
+    std::vector<float> data(count);
+    cudaMemcpy(&data[0], d_data, count*sizeof(float), cudaMemcpyDeviceToHost);
+    return data;
+}
+
+static void upload(float* d_data, const std::vector<float>& data) {
+    cudaMemcpy(d_data, &data[0], data.size()*sizeof(float), cudaMemcpyHostToDevice);
+}
+
+// true if a and b agree to a relative 'tolerance'. The solver's costs are float sums reduced with atomics,
+// so two solves taking the same steps still differ in the last digits
+static bool close(double a, double b, double tolerance) {
+    return std::fabs(a - b) <= tolerance*std::max(std::fabs(a), std::fabs(b)) + 1e-12;
+}
+
+// true if the costs of the iterations both solves ran agree to a relative 'tolerance'
+static bool sameCosts(const std::vector<Opt_IterationStatistics>& a, const std::vector<Opt_IterationStatistics>& b, double tolerance) {
+    size_t n = std::min(a.size(), b.size());
+    for (size_t i = 0; i < n; ++i) {
+        if (!close(a[i].cost, b[i].cost, tolerance)) {
+            return false;
+        }
+    }
+    return n > 0;
+}
+
+// true if no iteration raised the cost
+static bool nonIncreasing(double initialCost, const std::vector<Opt_IterationStatistics>& statistics) {
+    double previous = initialCost;
+    for (size_t i = 0; i < statistics.size(); ++i) {
+        if (!(statistics[i].cost <= previous*(1 + 1e-6))) {
+            return false;
+        }
+        previous = statistics[i].cost;
+    }
+    return true;
+}
+
+void solveLaplacian(int width, int height, float* unknown, float* target) {
+    Opt_State* state = newState();
     // load the Opt DSL file containing the cost description
     Opt_Problem* problem = Opt_ProblemDefine(state, "laplacian.t", "gaussNewtonGPU");
     // describe the dimensions of the instance of the problem
@@ -26,6 +132,810 @@ void solveLaplacian(int width, int height, float* unknown, float* target) {
     Opt_ProblemDelete(state, problem);
 }
 
+// residuals that look like a Stencil family but share a ComputedArray with gradient images
+void solveStencilFamilyGradient(int width, int height, float* unknown, float* target) {
+    Opt_State* state = newState();
+    Opt_Problem* problem = Opt_ProblemDefine(state, "stencil_family_gradient.t", "gaussNewtonGPU");
+    unsigned int dims[] = { width, height };
+    Opt_Plan* plan = Opt_ProblemPlan(state, problem, dims);
+    void* problem_data[] = { unknown, target };
+    Opt_ProblemSolve(state, plan, problem_data);
+    check(std::isfinite(Opt_ProblemCurrentCost(state, plan)), "stencil family sharing a ComputedArray with gradient images");
+    Opt_PlanFree(state, plan);
+    Opt_ProblemDelete(state, problem);
+}
+
+
+// geodesic acceleration corrects each LM step by the second directional derivative of the residuals.
+// That derivative is zero for the laplacian's linear residuals, so its steps must not change, and not
+// for X*X - A, whose steps must. LM keeps only steps that lower the cost, with or without the correction
+void solveGeodesicAcceleration(int width, int height, float* unknown, float* target) {
+    const char* filenames[] = { "laplacian.t", "nonlinear_fit.t" };
+    for (int i = 0; i < 2; ++i) {
+        std::vector<Opt_IterationStatistics> statistics[2];
+        double initialCost = 0;
+        for (int geodesic = 0; geodesic < 2; ++geodesic) {
+            TestPlan p = newPlan(filenames[i], "LMGPU", width, height);
+            setIntParameter(p, "use_geodesic_acceleration", geodesic);
+            statistics[geodesic] = solveFromTarget(p, width, height, unknown, target, &initialCost);
+            freePlan(p);
+        }
+        if (i == 0) {
+            check(sameCosts(statistics[0], statistics[1], 1e-4), "geodesic acceleration leaves the steps of linear residuals unchanged");
+        } else {
+            check(!sameCosts(statistics[0], statistics[1], 1e-4), "geodesic acceleration changes the steps of nonlinear residuals");
+        }
+        check(nonIncreasing(initialCost, statistics[1]), "geodesic accelerated LM never raises the cost");
+    }
+}
+
+// Anderson acceleration replaces the GN iterate by a mix of the last ones, and reverts a mix that raises the
+// cost. With 2 linear iterations per step, GN on X*X - A takes many inexact steps for it to mix
+void solveAndersonAcceleration(int width, int height, float* unknown, float* target) {
+    std::vector<Opt_IterationStatistics> statistics[2];
+    double initialCost = 0;
+    for (int depth = 0; depth < 2; ++depth) {
+        TestPlan p = newPlan("nonlinear_fit.t", "gaussNewtonGPU", width, height);
+        setIntParameter(p, "lIterations", 2);
+        setIntParameter(p, "anderson_depth", depth*3);
+        statistics[depth] = solveFromTarget(p, width, height, unknown, target, &initialCost);
+        freePlan(p);
+    }
+    check(!sameCosts(statistics[0], statistics[1], 1e-4), "Anderson acceleration changes the GN iterates");
+    check(!statistics[1].empty() && statistics[1].back().cost <= initialCost, "Anderson accelerated GN descends");
+}
+
+// With UseExactHessian the LM linear solve is a Steihaug truncated CG, so a step never leaves the region
+// |delta| <= steihaug_radius: from a start far from the minimum, the first step of exact_hessian.t must stop
+// at a radius of 0.01. Run to convergence, the exact Hessian must reach the same minimum as J^T J does
+// on the same energy
+void solveExactHessian(int width, int height, float* unknown, float* target) {
+    TestPlan p = newPlan("exact_hessian.t", "LMGPU", width, height);
+    float radius = 0.01f;
+    Opt_SetSolverParameter(p.state, p.plan, "steihaug_radius", &radius);
+    setIntParameter(p, "nIterations", 1);
+    solveFromTarget(p, width, height, unknown, target);
+    std::vector<float> start = download(target, width*height);
+    std::vector<float> step = download(unknown, width*height);
+    double norm2 = 0;
+    for (int i = 0; i < width*height; ++i) {
+        norm2 += (double)(step[i] - start[i])*(step[i] - start[i]);
+    }
+    check(std::sqrt(norm2) <= radius*1.01, "exact Hessian step stays inside steihaug_radius");
+    freePlan(p);
+
+    double costs[2];
+    const char* filenames[] = { "exact_hessian.t", "nonlinear_fit.t" };
+    for (int i = 0; i < 2; ++i) {
+        TestPlan q = newPlan(filenames[i], "LMGPU", width, height);
+        setIntParameter(q, "nIterations", 50);
+        std::vector<Opt_IterationStatistics> statistics = solveFromTarget(q, width, height, unknown, target);
+        costs[i] = statistics.empty() ? -1 : statistics.back().cost;
+        freePlan(q);
+    }
+    check(costs[0] >= 0 && close(costs[0], costs[1], 1e-2), "exact Hessian LM reaches the J^T J minimum");
+}
+
+// With eliminate_local_unknowns each iteration first solves for the per-pixel gain S of local_unknowns.t in
+// closed form with X fixed, S = (A X + 0.01)/(X^2 + 0.01), and the global PCG solve that follows is masked so
+// it leaves S there. After one iteration from S = 1, S must hold that value for the starting X
+void solveLocalUnknowns(int width, int height, float* unknown, float* target) {
+    int count = width*height;
+    std::vector<float> A = download(target, count);
+    std::vector<float> X(count), S(count, 1.0f);
+    for (int i = 0; i < count; ++i) {
+        X[i] = 0.5f*A[i] + 0.25f;
+    }
+    float* gain;
+    cudaMalloc(&gain, count*sizeof(float));
+    upload(unknown, X);
+    upload(gain, S);
+    TestPlan p = newPlan("local_unknowns.t", "gaussNewtonGPU", width, height);
+    setIntParameter(p, "eliminate_local_unknowns", 1);
+    setIntParameter(p, "nIterations", 1);
+    void* problem_data[] = { unknown, target, gain };
+    Opt_ProblemSolve(p.state, p.plan, problem_data);
+    std::vector<float> solved = download(gain, count);
+    bool closedForm = true;
+    for (int i = 0; i < count; ++i) {
+        double expected = (A[i]*X[i] + 0.01)/(X[i]*X[i] + 0.01);
+        closedForm = closedForm && close(solved[i], expected, 1e-3);
+    }
+    check(closedForm, "local unknowns take their closed-form value and the global solve leaves them there");
+    freePlan(p);
+    cudaFree(gain);
+}
+
+// the losses of robust_losses.t, as functions of the squared residual s
+static double huber(double s, double a) { return s <= a*a ? s : 2*a*std::sqrt(s) - a*a; }
+static double cauchy(double s, double c) { return c*c*std::log(1 + s/(c*c)); }
+static double tukey(double s, double c) { double t = 1 - s/(c*c); return s <= c*c ? c*c/3*(1 - t*t*t) : c*c/3; }
+
+// Σ 0.5 rho(s) of robust_losses.t at X. Residuals reading out of bounds are 0, which every loss maps to 0
+static double robustLossesCost(const std::vector<float>& X, const std::vector<float>& A, int width, int height) {
+    double cost = 0;
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            int i = y*width + x;
+            double fit = X[i] - A[i];
+            cost += 0.5*huber(fit*fit, 0.1);
+            if (x + 1 < width) {
+                double d = X[i] - X[i + 1];
+                cost += 0.5*cauchy(d*d, 0.5);
+            }
+            if (y + 1 < height) {
+                double d = X[i] - X[i + width];
+                cost += 0.5*tukey(d*d, 0.5);
+            }
+        }
+    }
+    return cost;
+}
+
+// The cost of robust residuals is 0.5 rho(s) of their squared norm. It must match a host evaluation at a start
+// with residuals on both sides of each loss's threshold, and again at the unknowns the IRLS solve ends with
+void solveRobustLosses(int width, int height, float* unknown, float* target) {
+    const char* solverkinds[] = { "gaussNewtonGPU", "LMGPU" };
+    int count = width*height;
+    std::vector<float> A = download(target, count);
+    std::vector<float> X(count);
+    for (int i = 0; i < count; ++i) {
+        X[i] = A[i] + 0.15f*(i % 7 - 3);
+    }
+    for (int i = 0; i < 2; ++i) {
+        upload(unknown, X);
+        TestPlan p = newPlan("robust_losses.t", solverkinds[i], width, height);
+        void* problem_data[] = { unknown, target };
+        Opt_ProblemInit(p.state, p.plan, problem_data);
+        double initial = Opt_ProblemCurrentCost(p.state, p.plan);
+        check(close(initial, robustLossesCost(X, A, width, height), 1e-3), "robust cost is 0.5 rho(s)");
+        while (Opt_ProblemStep(p.state, p.plan, problem_data)) {}
+        double cost = Opt_ProblemCurrentCost(p.state, p.plan);
+        check(close(cost, robustLossesCost(download(unknown, count), A, width, height), 1e-3), "robust cost after the solve is 0.5 rho(s)");
+        check(cost < initial, "robust solve lowers the cost");
+        freePlan(p);
+    }
+}
+
+// true if every entry is accepted exactly when its cost is below the one before, and a rejected step
+// keeps the cost unchanged
+static bool acceptedWhenLower(double initialCost, const std::vector<Opt_IterationStatistics>& statistics) {
+    double previous = initialCost;
+    for (size_t i = 0; i < statistics.size(); ++i) {
+        if (statistics[i].accepted ? !(statistics[i].cost < previous) : statistics[i].cost != previous) {
+            return false;
+        }
+        previous = statistics[i].cost;
+    }
+    return true;
+}
+
+// LMSpeculativeGPU evaluates several trust region radii per iteration and keeps the best candidate, if any
+// lowers the cost. Each iteration must be recorded as accepted exactly when the cost went down, with the
+// linear solve and radius of the candidate it reports
+void solveSpeculative(int width, int height, float* unknown, float* target) {
+    TestPlan p = newPlan("nonlinear_fit.t", "LMSpeculativeGPU", width, height);
+    setIntParameter(p, "nIterations", 20);
+    double initialCost = 0;
+    std::vector<Opt_IterationStatistics> statistics = solveFromTarget(p, width, height, unknown, target, &initialCost);
+    check(!statistics.empty() && statistics[0].accepted, "speculative solve accepts its first step");
+    check(acceptedWhenLower(initialCost, statistics), "speculative steps are recorded as accepted exactly when the cost went down");
+    bool recorded = true;
+    for (size_t i = 0; i < statistics.size(); ++i) {
+        recorded = recorded && statistics[i].linearIterations >= 1 && statistics[i].linearIterations <= 10 &&
+                   statistics[i].trustRegionRadius > 0 && statistics[i].linearMs >= 0 && statistics[i].evaluateMs >= 0;
+    }
+    check(recorded, "speculative steps record their linear solve");
+    freePlan(p);
+}
+
+// the gradient of asymmetric_stencil.t's energy at X, accumulated from each residual's partial derivatives
+static std::vector<double> asymmetricStencilGradient(const std::vector<float>& X, const std::vector<float>& A, int width, int height) {
+    std::vector<double> g(X.size(), 0.0);
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            int i = y*width + x;
+            g[i] += 0.2*0.2*(X[i] - A[i]);
+            if (x + 1 < width) {
+                double r = X[i + 1] - 0.5*X[i];
+                g[i + 1] += r;
+                g[i] -= 0.5*r;
+            }
+            if (x + 1 < width && y + 1 < height) {
+                double r = X[i + width] - 0.5*X[i + width + 1];
+                g[i + width] += r;
+                g[i + width + 1] -= 0.5*r;
+            }
+        }
+    }
+    return g;
+}
+
+static double norm(const std::vector<double>& v) {
+    double n2 = 0;
+    for (size_t i = 0; i < v.size(); ++i) {
+        n2 += v[i]*v[i];
+    }
+    return std::sqrt(n2);
+}
+
+// Σ 0.5 F^2 of asymmetric_stencil.t at X
+static double asymmetricStencilCost(const std::vector<float>& X, const std::vector<float>& A, int width, int height) {
+    double cost = 0;
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            int i = y*width + x;
+            double fit = 0.2*(X[i] - A[i]);
+            cost += 0.5*fit*fit;
+            if (x + 1 < width) {
+                double r = X[i + 1] - 0.5*X[i];
+                cost += 0.5*r*r;
+            }
+            if (x + 1 < width && y + 1 < height) {
+                double r = X[i + width] - 0.5*X[i + width + 1];
+                cost += 0.5*r*r;
+            }
+        }
+    }
+    return cost;
+}
+
+// The generators differentiate a residual once and shift the derivative to each instance that reads an unknown.
+// asymmetric_stencil.t is linear, so GN converges to its minimum only if those derivatives are right: the
+// gradient evaluated on the host must vanish there
+void solveShiftedDerivatives(int width, int height, float* unknown, float* target) {
+    int count = width*height;
+    std::vector<float> A = download(target, count);
+    TestPlan p = newPlan("asymmetric_stencil.t", "gaussNewtonGPU", width, height);
+    setIntParameter(p, "nIterations", 20);
+    solveFromTarget(p, width, height, unknown, target);
+    double initial = norm(asymmetricStencilGradient(A, A, width, height));
+    double solved = norm(asymmetricStencilGradient(download(unknown, count), A, width, height));
+    check(solved <= 1e-2*initial, "GN with shifted derivatives reaches the minimum of an asymmetric stencil");
+    freePlan(p);
+}
+
+// wide_residual_forward.t and wide_residual_reverse.t are the same energy with its derivatives generated in
+// forward and in reverse mode. The derivatives must agree, so GN must take the same steps on both
+void solveReverseMode(int width, int height, float* unknown, float* target) {
+    const char* filenames[] = { "wide_residual_forward.t", "wide_residual_reverse.t" };
+    std::vector<Opt_IterationStatistics> statistics[2];
+    double initialCost = 0;
+    for (int i = 0; i < 2; ++i) {
+        TestPlan p = newPlan(filenames[i], "gaussNewtonGPU", width, height);
+        setIntParameter(p, "nIterations", 5);
+        statistics[i] = solveFromTarget(p, width, height, unknown, target, &initialCost);
+        freePlan(p);
+    }
+    check(sameCosts(statistics[0], statistics[1], 1e-4), "reverse-mode derivatives match forward mode");
+    check(!statistics[1].empty() && statistics[1].back().cost < initialCost, "GN with reverse-mode derivatives descends");
+}
+
+// the gradient of stencil_family.t's energy at X
+static std::vector<double> stencilFamilyGradient(const std::vector<float>& X, const std::vector<float>& A, int width, int height) {
+    const int offsets[4][2] = { { 1, 0 }, { -1, 0 }, { 0, 1 }, { 0, -1 } };
+    std::vector<double> g(X.size(), 0.0);
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            int i = y*width + x;
+            g[i] += 0.2*0.2*(X[i] - A[i]);
+            for (int k = 0; k < 4; ++k) {
+                int ox = x + offsets[k][0], oy = y + offsets[k][1];
+                if (ox < 0 || ox >= width || oy < 0 || oy >= height) {
+                    continue;
+                }
+                int o = oy*width + ox;
+                double r = (1 + A[o])*X[o] - 0.5*X[i];
+                g[o] += (1 + A[o])*r;
+                g[i] -= 0.5*r;
+            }
+        }
+    }
+    return g;
+}
+
+// The regularization of stencil_family.t is one Stencil family, whose members take their derivatives from the
+// first member by renaming the moved accesses. The energy is linear, so GN converges to its minimum only if
+// every member's renamed derivatives are right: the gradient evaluated on the host must vanish there
+void solveStencilFamily(int width, int height, float* unknown, float* target) {
+    int count = width*height;
+    std::vector<float> A = download(target, count);
+    TestPlan p = newPlan("stencil_family.t", "gaussNewtonGPU", width, height);
+    setIntParameter(p, "nIterations", 20);
+    solveFromTarget(p, width, height, unknown, target);
+    double initial = norm(stencilFamilyGradient(A, A, width, height));
+    double solved = norm(stencilFamilyGradient(download(unknown, count), A, width, height));
+    check(solved <= 1e-2*initial, "GN with renamed Stencil family derivatives reaches the minimum");
+    freePlan(p);
+}
+
+// With fused evaluation the cost after an update also leaves J^T F, the preconditioner and, for LM, C^T C for
+// the next iteration, and PCGInit1 rescales that C^T C when the trust region radius changed since. The
+// solvers must take the same steps as with separate passes (nonlinear_fit_unfused.t), and LM must accept
+// the same steps and reach the same radii
+void solveFusedEvaluation(int width, int height, float* unknown, float* target) {
+    const char* solverkinds[] = { "gaussNewtonGPU", "LMGPU" };
+    const char* filenames[] = { "nonlinear_fit.t", "nonlinear_fit_unfused.t" };
+    for (int i = 0; i < 2; ++i) {
+        std::vector<Opt_IterationStatistics> statistics[2];
+        for (int j = 0; j < 2; ++j) {
+            TestPlan p = newPlan(filenames[j], solverkinds[i], width, height);
+            setIntParameter(p, "nIterations", 20);
+            statistics[j] = solveFromTarget(p, width, height, unknown, target);
+            freePlan(p);
+        }
+        bool same = sameCosts(statistics[0], statistics[1], 1e-4);
+        for (size_t k = 0; same && k < std::min(statistics[0].size(), statistics[1].size()); ++k) {
+            same = statistics[0][k].accepted == statistics[1][k].accepted &&
+                   close(statistics[0][k].trustRegionRadius, statistics[1][k].trustRegionRadius, 1e-4);
+        }
+        check(same, i == 0 ? "fused GN evaluation takes the unfused steps" : "fused LM evaluation takes the unfused steps and radii");
+    }
+}
+
+// Σ 0.5 F^2 of centered_and_graph.t at X, with the edges from i[k] to j[k]
+static double centeredAndGraphCost(const std::vector<float>& X, const std::vector<float>& A, const std::vector<int>& i, const std::vector<int>& j) {
+    double cost = 0;
+    for (size_t k = 0; k < X.size(); ++k) {
+        double fit = 0.2*(X[k] - A[k]);
+        cost += 0.5*fit*fit;
+    }
+    for (size_t k = 0; k < i.size(); ++k) {
+        double d = X[i[k]] - X[j[k]];
+        cost += 0.5*d*d;
+    }
+    return cost;
+}
+
+// centered_and_graph.t has one 1-D centered energy and one graph energy, so its cost, model cost and speculative
+// cost reductions each run as a single launch whose leading blocks run the centered kernel and the rest the
+// graph kernel. The cost must match a host evaluation of both energies, at the start and after GN, LM and
+// speculative LM solves
+void solveCenteredAndGraph(int count, float* unknown, float* target) {
+    std::vector<float> A = download(target, count);
+    int edges = 2*count;
+    std::vector<int> i(edges), j(edges);
+    for (int k = 0; k < count; ++k) {
+        i[k] = k;
+        j[k] = (k + 1) % count;
+        i[count + k] = k;
+        j[count + k] = (int)((k*7919LL + 13) % count);
+    }
+    int *d_i, *d_j;
+    cudaMalloc(&d_i, edges*sizeof(int));
+    cudaMalloc(&d_j, edges*sizeof(int));
+    cudaMemcpy(d_i, &i[0], edges*sizeof(int), cudaMemcpyHostToDevice);
+    cudaMemcpy(d_j, &j[0], edges*sizeof(int), cudaMemcpyHostToDevice);
+    const char* solverkinds[] = { "gaussNewtonGPU", "LMGPU", "LMSpeculativeGPU" };
+    for (int s = 0; s < 3; ++s) {
+        cudaMemcpy(unknown, target, count*sizeof(float), cudaMemcpyDeviceToDevice);
+        TestPlan p = newPlan("centered_and_graph.t", solverkinds[s], count, 1);
+        void* problem_data[] = { unknown, target, &edges, d_i, d_j };
+        Opt_ProblemInit(p.state, p.plan, problem_data);
+        check(close(Opt_ProblemCurrentCost(p.state, p.plan), centeredAndGraphCost(A, A, i, j), 1e-3), "fused centered and graph cost at the start");
+        while (Opt_ProblemStep(p.state, p.plan, problem_data)) {}
+        double cost = Opt_ProblemCurrentCost(p.state, p.plan);
+        check(close(cost, centeredAndGraphCost(download(unknown, count), A, i, j), 1e-3), "fused centered and graph cost after the solve");
+        freePlan(p);
+    }
+    cudaFree(d_i);
+    cudaFree(d_j);
+}
+
+// Generated stencil loads add a constant per offset to the thread's linear index instead of recomputing the
+// address from x and y. On a 500 x 300 image, where mixing up the row stride or an edge test shows, the cost
+// of asymmetric_stencil.t at scrambled unknowns must match a host evaluation, and GN must reach its minimum
+void solveLinearOffsets(float* unknown, float* target) {
+    const int width = 500, height = 300, count = width*height;
+    std::vector<float> A = download(target, count);
+    std::vector<float> X(count);
+    for (int i = 0; i < count; ++i) {
+        X[i] = A[(i*7919LL) % count];
+    }
+    upload(unknown, X);
+    TestPlan p = newPlan("asymmetric_stencil.t", "gaussNewtonGPU", width, height);
+    setIntParameter(p, "nIterations", 20);
+    void* problem_data[] = { unknown, target };
+    Opt_ProblemInit(p.state, p.plan, problem_data);
+    check(close(Opt_ProblemCurrentCost(p.state, p.plan), asymmetricStencilCost(X, A, width, height), 1e-3), "cost with linear offset loads on a non-square image");
+    while (Opt_ProblemStep(p.state, p.plan, problem_data)) {}
+    double initial = norm(asymmetricStencilGradient(X, A, width, height));
+    double solved = norm(asymmetricStencilGradient(download(unknown, count), A, width, height));
+    check(solved <= 1e-2*initial, "GN with linear offset loads reaches the minimum on a non-square image");
+    freePlan(p);
+}
+
+// the gradient of laplacian.t's energy at X
+static std::vector<double> laplacianGradient(const std::vector<float>& X, const std::vector<float>& A, int width, int height) {
+    std::vector<double> g(X.size(), 0.0);
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            int i = y*width + x;
+            g[i] += 0.2*0.2*(X[i] - A[i]);
+            if (x + 1 < width) {
+                double r = X[i] - X[i + 1];
+                g[i] += r;
+                g[i + 1] -= r;
+            }
+            if (y + 1 < height) {
+                double r = X[i] - X[i + width];
+                g[i] += r;
+                g[i + width] -= r;
+            }
+        }
+    }
+    return g;
+}
+
+// Σ 0.5 F^2 of laplacian.t at X, or of weighted_laplacian.t with fitting weight 'wFit'
+static double laplacianCost(const std::vector<float>& X, const std::vector<float>& A, int width, int height, double wFit = 0.2) {
+    double cost = 0;
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            int i = y*width + x;
+            double fit = wFit*(X[i] - A[i]);
+            cost += 0.5*fit*fit;
+            if (x + 1 < width) {
+                double r = X[i] - X[i + 1];
+                cost += 0.5*r*r;
+            }
+            if (y + 1 < height) {
+                double r = X[i] - X[i + width];
+                cost += 0.5*r*r;
+            }
+        }
+    }
+    return cost;
+}
+
+// Solver kernels are compiled when the host code launching them is, so only the paths a solver kind can take
+// are compiled. Each kind must still have every kernel it launches: with 25 linear iterations LM also runs
+// its residual resets, and GN, LM and speculative LM must all reach the laplacian's minimum
+void solveCompiledPaths(int width, int height, float* unknown, float* target) {
+    const char* solverkinds[] = { "gaussNewtonGPU", "LMGPU", "LMSpeculativeGPU" };
+    const char* checks[] = { "GN launches only compiled kernels", "LM with residual resets launches only compiled kernels",
+                             "speculative LM launches only compiled kernels" };
+    int count = width*height;
+    std::vector<float> A = download(target, count);
+    std::vector<float> X(count);
+    for (int i = 0; i < count; ++i) {
+        X[i] = A[(i*7919LL) % count];
+    }
+    double initial = norm(laplacianGradient(X, A, width, height));
+    for (int s = 0; s < 3; ++s) {
+        upload(unknown, X);
+        TestPlan p = newPlan("laplacian.t", solverkinds[s], width, height);
+        setIntParameter(p, "lIterations", 25);
+        void* problem_data[] = { unknown, target };
+        Opt_ProblemSolve(p.state, p.plan, problem_data);
+        double solved = norm(laplacianGradient(download(unknown, count), A, width, height));
+        check(solved <= 1e-2*initial, checks[s]);
+        freePlan(p);
+    }
+}
+
+// An async solve runs the iterations Opt_ProblemSolve would. Opt_SolvePoll must report a growing iteration
+// count, and once the solve has finished, the iterations the plan recorded and a final cost equal to that of
+// a synchronous solve of the same problem
+void solveAsync(int width, int height, float* unknown, float* target) {
+    TestPlan p = newPlan("laplacian.t", "LMGPU", width, height);
+    setIntParameter(p, "nIterations", 5);
+    solveFromTarget(p, width, height, unknown, target);
+    double synchronous = Opt_ProblemCurrentCost(p.state, p.plan);
+    freePlan(p);
+
+    cudaMemcpy(unknown, target, width*height*sizeof(float), cudaMemcpyDeviceToDevice);
+    TestPlan q = newPlan("laplacian.t", "LMGPU", width, height);
+    setIntParameter(q, "nIterations", 5);
+    void* problem_data[] = { unknown, target };
+    Opt_Solve* solve = Opt_ProblemSolveAsync(q.state, q.plan, problem_data);
+    int iteration = 0, previous = 0;
+    double cost = 0;
+    bool growing = true;
+    while (!Opt_SolvePoll(q.state, solve, &iteration, &cost)) {
+        growing = growing && iteration >= previous;
+        previous = iteration;
+    }
+    Opt_SolvePoll(q.state, solve, &iteration, &cost);
+    Opt_SolveWait(q.state, solve);
+    check(growing && iteration >= previous, "polled iteration count only grows");
+    check(iteration == Opt_PlanGetStatistics(q.state, q.plan, NULL, 0), "polled iterations of a finished async solve");
+    check(close(cost, synchronous, 1e-4) && close(Opt_ProblemCurrentCost(q.state, q.plan), synchronous, 1e-4), "async solve reaches the synchronous cost");
+    freePlan(q);
+}
+
+// With time_budget_ms a solve shrinks its linear solves to what its timing model says still fits and stops
+// when not even one linear iteration does, then restores the best unknowns it saw. Given 10 times the cost of
+// one iteration and 1000 iterations to run, the solve must stop early, the iterations must fit the budget up
+// to the model's error, and the final cost must be the lowest one recorded
+void solveTimeBudget(int width, int height, float* unknown, float* target) {
+    TestPlan p = newPlan("laplacian.t", "LMGPU", width, height);
+    setIntParameter(p, "nIterations", 1);
+    std::vector<Opt_IterationStatistics> one = solveFromTarget(p, width, height, unknown, target);
+    float budget = one.empty() ? 1.0f : (float)(10*one[0].totalMs);
+    Opt_SetSolverParameter(p.state, p.plan, "time_budget_ms", &budget);
+    setIntParameter(p, "nIterations", 1000);
+    std::vector<Opt_IterationStatistics> statistics = solveFromTarget(p, width, height, unknown, target);
+    double total = 0, lowest = 1e300;
+    for (size_t i = 0; i < statistics.size(); ++i) {
+        total += statistics[i].totalMs;
+        lowest = std::min(lowest, statistics[i].cost);
+    }
+    check(!statistics.empty() && statistics.size() < 1000, "time budget stops the solve early");
+    check(total <= 1.5*budget + (one.empty() ? 0 : one[0].totalMs), "iterations fit the time budget");
+    check(Opt_ProblemCurrentCost(p.state, p.plan) <= lowest*(1 + 1e-6), "time budgeted solve ends with the best unknowns");
+    freePlan(p);
+}
+
+// one problem defined, planned and solved from unknown = target in a state shared with other threads
+struct SharedStateSolve {
+    Opt_State* state;
+    const char* filename;
+    int width, height;
+    float* unknown;
+    float* target;
+    double cost;
+};
+
+static void solveInSharedState(SharedStateSolve* s) {
+    cudaMemcpy(s->unknown, s->target, s->width*s->height*sizeof(float), cudaMemcpyDeviceToDevice);
+    Opt_Problem* problem = Opt_ProblemDefine(s->state, s->filename, "LMGPU");
+    unsigned int dims[] = { (unsigned int)s->width, (unsigned int)s->height };
+    Opt_Plan* plan = Opt_ProblemPlan(s->state, problem, dims);
+    void* problem_data[] = { s->unknown, s->target };
+    Opt_ProblemSolve(s->state, plan, problem_data);
+    s->cost = Opt_ProblemCurrentCost(s->state, plan);
+    Opt_PlanFree(s->state, plan);
+    Opt_ProblemDelete(s->state, problem);
+}
+
+// Two threads define, plan and solve different problems in one state at the same time. Compilation is
+// serialized and the solves run concurrently, and each must end with the cost it reaches alone
+void solveConcurrently(int width, int height, float* unknown, float* target) {
+    const char* filenames[] = { "laplacian.t", "asymmetric_stencil.t" };
+    double alone[2];
+    for (int i = 0; i < 2; ++i) {
+        TestPlan p = newPlan(filenames[i], "LMGPU", width, height);
+        solveFromTarget(p, width, height, unknown, target);
+        alone[i] = Opt_ProblemCurrentCost(p.state, p.plan);
+        freePlan(p);
+    }
+    Opt_State* state = newState();
+    float* second;
+    cudaMalloc(&second, width*height*sizeof(float));
+    SharedStateSolve solves[2] = { { state, filenames[0], width, height, unknown, target, 0 },
+                                   { state, filenames[1], width, height, second, target, 0 } };
+    std::thread first(solveInSharedState, &solves[0]);
+    solveInSharedState(&solves[1]);
+    first.join();
+    cudaFree(second);
+    check(close(solves[0].cost, alone[0], 1e-4) && close(solves[1].cost, alone[1], 1e-4), "concurrent solves in one state reach their own costs");
+}
+
+// Two plans of the same size in a state with sharedSolverScratch borrow scratch of one size class. Stepped
+// in turn they hold it at once, and solved one after the other the second reuses the first's, and either
+// way each must take the steps it takes with scratch of its own
+void solveSharedScratch(int width, int height, float* unknown, float* target) {
+    const char* filenames[] = { "laplacian.t", "asymmetric_stencil.t" };
+    std::vector<Opt_IterationStatistics> alone[2];
+    for (int i = 0; i < 2; ++i) {
+        TestPlan p = newPlan(filenames[i], "LMGPU", width, height);
+        alone[i] = solveFromTarget(p, width, height, unknown, target);
+        freePlan(p);
+    }
+    Opt_State* state = newState(1);
+    TestPlan plans[2];
+    for (int i = 0; i < 2; ++i) {
+        plans[i].state = state;
+        plans[i].problem = Opt_ProblemDefine(state, filenames[i], "LMGPU");
+        unsigned int dims[] = { (unsigned int)width, (unsigned int)height };
+        plans[i].plan = Opt_ProblemPlan(state, plans[i].problem, dims);
+    }
+    float* second;
+    cudaMalloc(&second, width*height*sizeof(float));
+    float* unknowns[] = { unknown, second };
+    void* problem_data[2][2];
+    for (int i = 0; i < 2; ++i) {
+        cudaMemcpy(unknowns[i], target, width*height*sizeof(float), cudaMemcpyDeviceToDevice);
+        problem_data[i][0] = unknowns[i];
+        problem_data[i][1] = target;
+        Opt_ProblemInit(state, plans[i].plan, problem_data[i]);
+    }
+    bool running[] = { true, true };
+    while (running[0] || running[1]) {
+        for (int i = 0; i < 2; ++i) {
+            running[i] = running[i] && Opt_ProblemStep(state, plans[i].plan, problem_data[i]) != 0;
+        }
+    }
+    for (int i = 0; i < 2; ++i) {
+        check(sameCosts(getStatistics(plans[i]), alone[i], 1e-4), "interleaved solves with shared scratch take their own steps");
+    }
+    for (int i = 0; i < 2; ++i) {
+        std::vector<Opt_IterationStatistics> statistics = solveFromTarget(plans[i], width, height, unknowns[i], target);
+        check(sameCosts(statistics, alone[i], 1e-4), "consecutive solves reusing shared scratch take their own steps");
+    }
+    cudaFree(second);
+    for (int i = 0; i < 2; ++i) {
+        freePlan(plans[i]);
+    }
+}
+
+// cancels an async solve as soon as it starts. Waiting must return, and the plan must solve again afterwards,
+// with the cancelled solve's shared scratch given back
+void solveAsyncCancelled(int width, int height, float* unknown, float* target) {
+    cudaMemcpy(unknown, target, width*height*sizeof(float), cudaMemcpyDeviceToDevice);
+    Opt_State* state = newState(1);
+    Opt_Problem* problem = Opt_ProblemDefine(state, "laplacian.t", "gaussNewtonGPU");
+    unsigned int dims[] = { (unsigned int)width, (unsigned int)height };
+    Opt_Plan* plan = Opt_ProblemPlan(state, problem, dims);
+    int nIterations = 50;
+    Opt_SetSolverParameter(state, plan, "nIterations", &nIterations);
+    void* problem_data[] = { unknown, target };
+    Opt_Solve* solve = Opt_ProblemSolveAsync(state, plan, problem_data);
+    Opt_SolveCancel(state, solve);
+    Opt_SolveWait(state, solve);
+    check(Opt_PlanGetStatistics(state, plan, NULL, 0) < nIterations, "cancelled async solve stops early");
+    Opt_ProblemSolve(state, plan, problem_data);
+    check(std::isfinite(Opt_ProblemCurrentCost(state, plan)), "solve after a cancelled async solve");
+    Opt_PlanFree(state, plan);
+    Opt_ProblemDelete(state, problem);
+}
+
+// A plan with bound parameters solves with NULL problemparams and must reach the cost of an unbound solve.
+// Once Opt_PlanUpdateParameter points A at another image, the next solve must reach the minimum for that one
+void solveBound(int width, int height, float* unknown, float* target) {
+    int count = width*height;
+    TestPlan unbound = newPlan("laplacian.t", "gaussNewtonGPU", width, height);
+    setIntParameter(unbound, "lIterations", 25);
+    solveFromTarget(unbound, width, height, unknown, target);
+    double expected = Opt_ProblemCurrentCost(unbound.state, unbound.plan);
+    freePlan(unbound);
+
+    TestPlan p = newPlan("laplacian.t", "gaussNewtonGPU", width, height);
+    setIntParameter(p, "lIterations", 25);
+    cudaMemcpy(unknown, target, count*sizeof(float), cudaMemcpyDeviceToDevice);
+    void* problem_data[] = { unknown, target };
+    Opt_PlanBindParameters(p.state, p.plan, problem_data);
+    Opt_ProblemSolve(p.state, p.plan, NULL);
+    check(close(Opt_ProblemCurrentCost(p.state, p.plan), expected, 1e-4), "bound solve with NULL problemparams reaches the unbound cost");
+    check(Opt_PlanUpdateParameter(p.state, p.plan, "NotAParameter", target) == 0, "update of an unknown parameter name");
+
+    std::vector<float> A = download(target, count);
+    std::vector<float> B(count);
+    for (int i = 0; i < count; ++i) {
+        B[i] = 1.0f - A[i];
+    }
+    float* other;
+    cudaMalloc(&other, count*sizeof(float));
+    upload(other, B);
+    check(Opt_PlanUpdateParameter(p.state, p.plan, "A", other) == 1, "update of a bound parameter");
+    double initial = norm(laplacianGradient(download(unknown, count), B, width, height));
+    Opt_ProblemSolve(p.state, p.plan, NULL);
+    double solved = norm(laplacianGradient(download(unknown, count), B, width, height));
+    check(solved <= 1e-2*initial, "bound solve after an update fits the new image");
+    cudaFree(other);
+    freePlan(p);
+}
+
+// The cost cached by the last step belongs to the parameters it ran with. After Opt_PlanUpdateParameter points A
+// at another image, and after Opt_PlanBindParameters rebinds the original, Opt_ProblemCurrentCost must
+// return the cost for the new parameters at the solved unknowns
+void solveCostAfterUpdate(int width, int height, float* unknown, float* target) {
+    int count = width*height;
+    std::vector<float> A = download(target, count);
+    std::vector<float> B(count);
+    for (int i = 0; i < count; ++i) {
+        B[i] = 1.0f - A[i];
+    }
+    float* other;
+    cudaMalloc(&other, count*sizeof(float));
+    upload(other, B);
+    TestPlan p = newPlan("laplacian.t", "gaussNewtonGPU", width, height);
+    setIntParameter(p, "nIterations", 2);
+    cudaMemcpy(unknown, target, count*sizeof(float), cudaMemcpyDeviceToDevice);
+    void* problem_data[] = { unknown, target };
+    Opt_PlanBindParameters(p.state, p.plan, problem_data);
+    Opt_ProblemSolve(p.state, p.plan, NULL);
+    std::vector<float> X = download(unknown, count);
+    check(close(Opt_ProblemCurrentCost(p.state, p.plan), laplacianCost(X, A, width, height), 1e-3), "cost after a bound solve");
+    Opt_PlanUpdateParameter(p.state, p.plan, "A", other);
+    check(close(Opt_ProblemCurrentCost(p.state, p.plan), laplacianCost(X, B, width, height), 1e-3), "cost after updating a parameter");
+    Opt_PlanBindParameters(p.state, p.plan, problem_data);
+    check(close(Opt_ProblemCurrentCost(p.state, p.plan), laplacianCost(X, A, width, height), 1e-3), "cost after binding the parameters again");
+    cudaFree(other);
+    freePlan(p);
+}
+
+// A solve records one statistics entry per outer iteration, up to nIterations. In each, the linear solve and
+// the evaluation fit in the iteration's time and the linear iterations in lIterations. LM reports a positive
+// trust region radius and a model cost no higher than the cost it started from, and is recorded as accepted
+// exactly when the cost went down; GN has neither and keeps every step. The csv has a header and a row per entry
+void solveStatistics(int width, int height, float* unknown, float* target) {
+    const char* solverkinds[] = { "gaussNewtonGPU", "LMGPU" };
+    const char* checks[] = { "GN statistics are consistent", "LM statistics are consistent" };
+    const int nIterations = 5, lIterations = 10;
+    for (int s = 0; s < 2; ++s) {
+        TestPlan p = newPlan("laplacian.t", solverkinds[s], width, height);
+        setIntParameter(p, "nIterations", nIterations);
+        setIntParameter(p, "lIterations", lIterations);
+        double initialCost;
+        std::vector<Opt_IterationStatistics> statistics = solveFromTarget(p, width, height, unknown, target, &initialCost);
+        bool consistent = !statistics.empty() && (int)statistics.size() <= nIterations;
+        double previous = initialCost;
+        for (size_t i = 0; i < statistics.size(); ++i) {
+            const Opt_IterationStatistics& e = statistics[i];
+            consistent = consistent && e.linearMs >= 0 && e.evaluateMs >= 0 && e.linearMs + e.evaluateMs <= e.totalMs + 1e-6 &&
+                         e.linearIterations >= 1 && e.linearIterations <= lIterations;
+            if (s == 0) {
+                consistent = consistent && e.modelCost == 0 && e.trustRegionRadius == 0 && e.accepted;
+            } else {
+                consistent = consistent && e.trustRegionRadius > 0 && e.modelCost <= previous*(1 + 1e-5);
+            }
+            previous = e.cost;
+        }
+        check(consistent, checks[s]);
+        if (s == 1) {
+            check(acceptedWhenLower(initialCost, statistics), "LM steps are recorded as accepted exactly when the cost went down");
+        }
+        Opt_IterationStatistics first;
+        check(Opt_PlanGetStatistics(p.state, p.plan, &first, 1) == (int)statistics.size() && first.cost == statistics[0].cost,
+              "statistics count when copying fewer entries");
+        check(Opt_PlanWriteStatistics(p.state, p.plan, "statistics.csv", "csv") == 1, "statistics written as csv");
+        std::ifstream csv("statistics.csv");
+        int lines = 0;
+        for (std::string line; std::getline(csv, line);) {
+            ++lines;
+        }
+        check(lines == (int)statistics.size() + 1, "csv statistics have a header and a row per iteration");
+        check(Opt_PlanWriteStatistics(p.state, p.plan, "statistics.json", "json") == 1, "statistics written as json");
+        check(Opt_PlanWriteStatistics(p.state, p.plan, "statistics.txt", "xml") == 0, "unknown statistics format rejected");
+        freePlan(p);
+    }
+}
+
+// what the iteration callback saw, and the fitting weight it raises after the second iteration
+struct CallbackLog {
+    std::vector<int> iterations;
+    std::vector<Opt_IterationStatistics> statistics;
+    float* wFit;
+};
+
+static int raiseFitAfterSecondIteration(const Opt_IterationStatistics* statistics, int iteration, void* userdata) {
+    CallbackLog* log = (CallbackLog*)userdata;
+    log->iterations.push_back(iteration);
+    log->statistics.push_back(*statistics);
+    if (iteration == 1) {
+        *log->wFit = 1.0f;
+        return OPT_ITERATION_STOP | OPT_ITERATION_PARAMETERS_CHANGED;
+    }
+    return OPT_ITERATION_CONTINUE;
+}
+
+// The callback runs after every iteration with its index and the statistics the plan records. This one raises
+// the fitting weight through the scalar's pointer and ends the solve after the second iteration, reporting the
+// change, so the cost afterwards must be that of the solved unknowns under the new weight
+void solveWithCallback(int width, int height, float* unknown, float* target) {
+    int count = width*height;
+    TestPlan p = newPlan("weighted_laplacian.t", "LMGPU", width, height);
+    setIntParameter(p, "nIterations", 10);
+    float wFit = 0.2f;
+    CallbackLog log;
+    log.wFit = &wFit;
+    Opt_SetIterationCallback(p.state, p.plan, raiseFitAfterSecondIteration, &log);
+    std::vector<Opt_IterationStatistics> statistics = solveFromTarget(p, width, height, unknown, target, NULL, &wFit);
+    bool consecutive = log.iterations.size() == 2 && statistics.size() == 2;
+    for (size_t i = 0; consecutive && i < log.iterations.size(); ++i) {
+        consecutive = log.iterations[i] == (int)i && log.statistics[i].cost == statistics[i].cost &&
+                      log.statistics[i].linearIterations == statistics[i].linearIterations && log.statistics[i].accepted == statistics[i].accepted;
+    }
+    check(consecutive, "callback sees each iteration's index and recorded statistics, and stops the solve");
+    std::vector<float> X = download(unknown, count);
+    std::vector<float> A = download(target, count);
+    check(close(Opt_ProblemCurrentCost(p.state, p.plan), laplacianCost(X, A, width, height, 1.0), 1e-3),
+          "cost after a callback changed the parameters uses the new values");
+    freePlan(p);
+}
+
 void saveMonochromeImage(char const * filename, const int width, const int height, float* d_data) {
     float *data = new float[width*height];
     cudaMemcpy(data, d_data, width*height*sizeof(float), cudaMemcpyDeviceToHost);
@@ -59,7 +969,34 @@ int main(){
     saveMonochromeImage("target.png", dim, dim, target);
     saveMonochromeImage("result.png", dim, dim, unknown);
 
+    cudaMemcpy(unknown, target, fSize, cudaMemcpyDeviceToDevice);
+    solveStencilFamilyGradient(dim, dim, unknown, target);
+
+    solveGeodesicAcceleration(dim, dim, unknown, target);
+    solveAndersonAcceleration(dim, dim, unknown, target);
+    solveExactHessian(dim, dim, unknown, target);
+    solveLocalUnknowns(dim, dim, unknown, target);
+    solveRobustLosses(dim, dim, unknown, target);
+    solveSpeculative(dim, dim, unknown, target);
+    solveShiftedDerivatives(dim, dim, unknown, target);
+    solveReverseMode(dim, dim, unknown, target);
+    solveStencilFamily(dim, dim, unknown, target);
+    solveFusedEvaluation(dim, dim, unknown, target);
+    solveCenteredAndGraph(dim*dim, unknown, target);
+    solveLinearOffsets(unknown, target);
+    solveCompiledPaths(dim, dim, unknown, target);
+    solveTimeBudget(dim, dim, unknown, target);
+    solveConcurrently(dim, dim, unknown, target);
+    solveSharedScratch(dim, dim, unknown, target);
+
+    solveAsync(dim, dim, unknown, target);
+    solveAsyncCancelled(dim, dim, unknown, target);
+    solveBound(dim, dim, unknown, target);
+    solveCostAfterUpdate(dim, dim, unknown, target);
+    solveStatistics(dim, dim, unknown, target);
+    solveWithCallback(dim, dim, unknown, target);
+
     cudaFree(target);
     cudaFree(unknown);
-    return 0;
+    return failures == 0 ? 0 : 1;
 }
\ No newline at end of file
@@ -0,0 +1,6 @@
+W,H = Dim("W",0), Dim("H",1)
+X = Unknown("X",float,{W,H},0)
+A = Array("A",float,{W,H},1)
+Energy(Huber(X(0,0) - A(0,0), 0.1), --fitting, linear for outliers
+Cauchy(X(0,0) - X(1,0), 0.5), --regularization
+Tukey(X(0,0) - X(0,1), 0.5))
\ No newline at end of file
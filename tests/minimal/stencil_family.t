@@ -0,0 +1,10 @@
+W,H = Dim("W",0), Dim("H",1)
+X = Unknown("X",float,{W,H},0)
+A = Array("A",float,{W,H},1)
+w_fit = .2
+Energy(w_fit*(X(0,0) - A(0,0))) --fitting
+-- one family: each member moves X and its weight A by the same offset and keeps X(0,0),
+-- so its derivatives are derived from the first member by renaming
+for x,y in Stencil { {1,0}, {-1,0}, {0,1}, {0,-1} } do
+    Energy((1 + A(x,y))*X(x,y) - 0.5*X(0,0)) --regularization
+end
\ No newline at end of file
@@ -0,0 +1,10 @@
+W,H = Dim("W",0), Dim("H",1)
+X = Unknown("X",float,{W,H},0)
+A = Array("A",float,{W,H},1)
+-- B depends on X, so it has gradient images. The last two residuals only differ by a moved X access
+-- and share the unmoved B(0,0), whose derivative reads B's gradient images: they must not be
+-- derived from each other by renaming
+B = ComputedArray("B",{W,H},X(0,0)*X(0,0) + 1)
+Energy(X(0,0) - A(0,0), --fitting
+B(0,0)*(X(0,0) - X(1,0)), --weighted regularization
+B(0,0)*(X(0,0) - X(0,1)))
@@ -0,0 +1,8 @@
+W,H = Dim("W",0), Dim("H",1)
+X = Unknown("X",float,{W,H},0)
+A = Array("A",float,{W,H},1)
+-- laplacian.t with the fitting weight passed in, so it can change during a solve
+w_fit = Param("w_fit",float,2)
+Energy(w_fit*(X(0,0) - A(0,0)), --fitting
+(X(0,0) - X(1,0)), --regularization
+(X(0,0) - X(0,1)))
\ No newline at end of file
@@ -0,0 +1,16 @@
+W,H = Dim("W",0), Dim("H",1)
+X = Unknown("X",float,{W,H},0)
+A = Array("A",float,{W,H},1)
+UseReverseMode(true)
+-- the fitting residual reads the whole 3x3 neighborhood through one shared sum, so its partials
+-- share most of their subexpressions
+local s = 0
+for i = -1,1 do
+    for j = -1,1 do
+        s = s + X(i,j)
+    end
+end
+s = s/9
+Energy(s*s - A(0,0), --fitting
+(X(0,0) - X(1,0)), --regularization
+(X(0,0) - X(0,1)))
\ No newline at end of file